@@ -5,6 +5,8 @@
 
 #include "cmds.h"
 #include "hardware.h"
+#include "eventlog.h"
+#include "stamp.h"
 
 extern struct NelmaX NELMAX;
 
@@ -12,6 +14,21 @@ static const uint8_t NIBBLE_ASCII[] = {
   '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'A', 'B', 'C', 'D', 'E', 'F'
 };
 
+// Stream position (= offset of the next byte) at the point a stream last
+// started, finished, or was aborted. Survives reset() so the host can resume
+uint16_t stream_checkpoint = 0;
+
+void save_stream_checkpoint(void)
+{
+  stream_checkpoint = ((uint16_t) state.stream.addr_h << 8) | state.stream.addr_l;
+}
+
+static uint16_t payload_u16(size_t index)
+{
+  const uint8_t *payload = nelmax_payload(&NELMAX);
+  return ((uint16_t) payload[index] << 8) | payload[index + 1];
+}
+
 ResponseCode string_error_response(const char *str)
 {
   NELMAX.nelma.response_size = 0;
@@ -32,9 +49,9 @@ ResponseCode cmd_ping(size_t payload_size)
 
 ResponseCode cmd_version(void)
 {
-  // 2.1
+  // 2.2
+  nelmax_write(&NELMAX, 0x02);
   nelmax_write(&NELMAX, 0x02);
-  nelmax_write(&NELMAX, 0x01);
   return STATUS_OK;
 }
 
@@ -107,6 +124,7 @@ ResponseCode cmd_write_block(uint8_t addr_h)
   } else if (state.passthrough) {
     return string_error_response("Pass-through mode: block writes not allowed");
   }
+  invalidate_stamp();
   cfg_A0_15_output();
   write_A8_15(addr_h);
   cfg_D0_7_output();
@@ -125,44 +143,118 @@ ResponseCode cmd_write_block(uint8_t addr_h)
   return STATUS_OK;
 }
 
-ResponseCode cmd_rx_stream(void)
+ResponseCode cmd_rx_stream(uint16_t offset, uint16_t length, bool verify)
 {
   if (!state.unlocked) {
     return string_error_response("Locked: rx stream not allowed");
   } else if (state.passthrough) {
     return string_error_response("Pass-through mode: rx stream not allowed");
+  } else if (offset >= 0x8000 || length == 0 || length > 0x8000 - offset) {
+    return string_error_response("Invalid rx stream range");
   }
+  invalidate_stamp();
   state.tag = STATE_RX_STREAM;
-  state.stream.addr_h = 0x00;
-  state.stream.addr_l = 0x00;
-  state.stream.remaining = 0x8000;
+  log_event(EVENT_LOG_STREAM_START, STATE_RX_STREAM);
+  state.stream.addr_h = (uint8_t)(offset >> 8);
+  state.stream.addr_l = (uint8_t) offset;
+  state.stream.remaining = length;
+  state.stream.verify = verify;
+  save_stream_checkpoint();
   cfg_A0_15_output();
-  write_A8_15(0x00);
+  write_A8_15(state.stream.addr_h);
   cfg_D0_7_output();
 
   return STATUS_OK;
 }
 
-ResponseCode cmd_tx_stream(void)
+ResponseCode cmd_tx_stream(uint16_t offset, uint16_t length)
 {
   if (!state.unlocked) {
     return string_error_response("Locked: tx stream not allowed");
   } else if (state.passthrough) {
     return string_error_response("Pass-through mode: tx stream not allowed");
+  } else if (offset >= 0x8000 || length == 0 || length > 0x8000 - offset) {
+    return string_error_response("Invalid tx stream range");
   }
   state.tag = STATE_TX_STREAM;
-  state.stream.addr_h = 0x00;
-  state.stream.addr_l = 0x00;
-  state.stream.remaining = 0x8000;
+  log_event(EVENT_LOG_STREAM_START, STATE_TX_STREAM);
+  state.stream.addr_h = (uint8_t)(offset >> 8);
+  state.stream.addr_l = (uint8_t) offset;
+  state.stream.remaining = length;
+  save_stream_checkpoint();
   cfg_A0_15_output();
-  write_A8_15(0x00);
+  write_A8_15(state.stream.addr_h);
   low_OE();
 
   return STATUS_OK;
 }
 
+ResponseCode cmd_stream_checkpoint(void)
+{
+  nelmax_write(&NELMAX, (uint8_t)(stream_checkpoint >> 8));
+  nelmax_write(&NELMAX, (uint8_t) stream_checkpoint);
+  return STATUS_OK;
+}
+
+ResponseCode cmd_set_stamp(uint16_t length, uint32_t checksum)
+{
+  if (!state.unlocked) {
+    return string_error_response("Locked: stamping not allowed");
+  } else if (state.passthrough) {
+    return string_error_response("Pass-through mode: stamping not allowed");
+  } else if (length == 0 || length > 0x8000) {
+    return string_error_response("Invalid stamp length");
+  } else if (sram_checksum(length) != checksum) {
+    return string_error_response("Stamp does not match SRAM");
+  }
+  store_stamp(length, checksum);
+  return STATUS_OK;
+}
+
+ResponseCode cmd_get_stamp(void)
+{
+  nelmax_write(&NELMAX, is_retain_enabled());
+  nelmax_write(&NELMAX, stamp.valid);
+  nelmax_write(&NELMAX, (uint8_t)(stamp.length >> 8));
+  nelmax_write(&NELMAX, (uint8_t) stamp.length);
+  for (uint8_t i = 0; i < 4; i++) {
+    nelmax_write(&NELMAX, (uint8_t)(stamp.checksum >> (24 - 8 * i)));
+  }
+  return STATUS_OK;
+}
+
+ResponseCode cmd_set_retain(bool value)
+{
+  set_retain_enabled(value);
+  return STATUS_OK;
+}
+
+// Response: dropped event count, event count, current frame (BE16), and
+// EVENTLOG_SIZE records of code, arg, frame (BE16). Unused records are zero
+ResponseCode cmd_drain_events(void)
+{
+  nelmax_write(&NELMAX, eventlog_take_dropped());
+  uint8_t count = eventlog_count();
+  nelmax_write(&NELMAX, count);
+  uint16_t frame = eventlog_frame();
+  nelmax_write(&NELMAX, (uint8_t)(frame >> 8));
+  nelmax_write(&NELMAX, (uint8_t) frame);
+  for (uint8_t i = 0; i < EVENTLOG_SIZE; i++) {
+    struct LoggedEvent event = {0};
+    if (i < count) {
+      event = eventlog_pop();
+    }
+    nelmax_write(&NELMAX, event.code);
+    nelmax_write(&NELMAX, event.arg);
+    nelmax_write(&NELMAX, (uint8_t)(event.frame >> 8));
+    nelmax_write(&NELMAX, (uint8_t) event.frame);
+  }
+  return STATUS_OK;
+}
+
 ResponseCode dispatch_command(uint8_t command, size_t payload_size)
 {
+  log_event(EVENT_LOG_COMMAND, command);
   switch (command) {
     case 0x01:
       if (payload_size <= 8) {
@@ -206,12 +298,52 @@ ResponseCode dispatch_command(uint8_t command, size_t payload_size)
       break;
     case 0x09:
       if (payload_size == 0) {
-        return cmd_rx_stream();
+        return cmd_rx_stream(0x0000, 0x8000, false);
+      } else if (payload_size == 2) {
+        return cmd_rx_stream(payload_u16(0), 0x8000 - payload_u16(0), false);
+      } else if (payload_size == 4) {
+        return cmd_rx_stream(payload_u16(0), payload_u16(2), false);
       }
       break;
     case 0x0A:
       if (payload_size == 0) {
-        return cmd_tx_stream();
+        return cmd_tx_stream(0x0000, 0x8000);
+      } else if (payload_size == 2) {
+        return cmd_tx_stream(payload_u16(0), 0x8000 - payload_u16(0));
+      } else if (payload_size == 4) {
+        return cmd_tx_stream(payload_u16(0), payload_u16(2));
+      }
+      break;
+    case 0x0B:
+      if (payload_size == 0) {
+        return cmd_stream_checkpoint();
+      }
+      break;
+    case 0x0C:
+      if (payload_size == 0) {
+        return cmd_rx_stream(0x0000, 0x8000, true);
+      } else if (payload_size == 2) {
+        return cmd_rx_stream(payload_u16(0), 0x8000 - payload_u16(0), true);
+      }
+      break;
+    case 0x0D:
+      if (payload_size == 6) {
+        return cmd_set_stamp(payload_u16(0), ((uint32_t) payload_u16(2) << 16) | payload_u16(4));
+      }
+      break;
+    case 0x0E:
+      if (payload_size == 0) {
+        return cmd_get_stamp();
+      }
+      break;
+    case 0x0F:
+      if (payload_size == 1) {
+        return cmd_set_retain(nelmax_payload(&NELMAX)[0]);
+      }
+      break;
+    case 0x10:
+      if (payload_size == 0) {
+        return cmd_drain_events();
       }
       break;
   }
@@ -24,10 +24,12 @@ struct State {
     uint8_t addr_h;
     uint8_t addr_l;
     uint16_t remaining;
+    bool verify;
   } stream;
 };
 
 extern struct State state;
+extern uint16_t stream_checkpoint;
 
 const uint8_t STATUS_OK = 0xFF;
 const uint8_t STATUS_ERR_STR = 0xFE;
@@ -35,5 +37,6 @@ const uint8_t STATUS_ERR_STR = 0xFE;
 typedef uint8_t ResponseCode;
 
 extern ResponseCode dispatch_command(uint8_t command, size_t payload_size);
+extern void save_stream_checkpoint(void);
 
 #endif	/* CMDS_H */
@@ -0,0 +1,106 @@
+#include "system.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "eventlog.h"
+
+#define EVENTLOG_MASK (EVENTLOG_SIZE - 1)
+
+// Kept across watchdog and other non-power-on resets, so the events that
+// led to the reset can still be drained afterwards
+static __persistent struct LoggedEvent ring[EVENTLOG_SIZE];
+static __persistent uint8_t head;
+static __persistent uint8_t count;
+static __persistent uint8_t dropped;
+
+static uint16_t last_frame;
+static uint8_t frame_wraps;
+
+static uint16_t read_frame(void)
+{
+  uint8_t low = UFRML;
+  return ((uint16_t)(UFRMH & 0x07) << 8) | low;
+}
+
+void eventlog_init(void)
+{
+  if (!RCONbits.POR || head > EVENTLOG_MASK || count > EVENTLOG_SIZE) {
+    head = 0;
+    count = 0;
+    dropped = 0;
+  }
+  uint8_t rcon = RCON;
+  RCONbits.POR = 1;
+  RCONbits.BOR = 1;
+  log_event(EVENT_LOG_BOOT, rcon);
+}
+
+// Called from the SOF interrupt handler
+void eventlog_sof(void)
+{
+  uint16_t frame = read_frame();
+  if (frame < last_frame) {
+    frame_wraps += 1;
+  }
+  last_frame = frame;
+}
+
+uint16_t eventlog_frame(void)
+{
+  bool gie = INTCONbits.GIE;
+  INTCONbits.GIE = 0;
+  uint16_t frame = read_frame();
+  uint8_t wraps = frame_wraps;
+  if (frame < last_frame) {
+    // Wrapped, but the SOF interrupt hasn't been handled yet
+    wraps += 1;
+  }
+  INTCONbits.GIE = gie;
+  return ((uint16_t) wraps << 11) | frame;
+}
+
+// Safe to call from both the main loop and interrupt handlers. When the
+// ring is full, the oldest event is overwritten
+void log_event(enum EventCode code, uint8_t arg)
+{
+  uint16_t frame = eventlog_frame();
+  bool gie = INTCONbits.GIE;
+  INTCONbits.GIE = 0;
+  ring[head].code = code;
+  ring[head].arg = arg;
+  ring[head].frame = frame;
+  head = (head + 1) & EVENTLOG_MASK;
+  if (count < EVENTLOG_SIZE) {
+    count += 1;
+  } else if (dropped < 0xFF) {
+    dropped += 1;
+  }
+  INTCONbits.GIE = gie;
+}
+
+uint8_t eventlog_count(void)
+{
+  return count;
+}
+
+// Returns the number of overwritten events since the previous call
+uint8_t eventlog_take_dropped(void)
+{
+  bool gie = INTCONbits.GIE;
+  INTCONbits.GIE = 0;
+  uint8_t value = dropped;
+  dropped = 0;
+  INTCONbits.GIE = gie;
+  return value;
+}
+
+// Removes and returns the oldest event. The log must not be empty
+struct LoggedEvent eventlog_pop(void)
+{
+  bool gie = INTCONbits.GIE;
+  INTCONbits.GIE = 0;
+  struct LoggedEvent event = ring[(uint8_t)(head - count) & EVENTLOG_MASK];
+  count -= 1;
+  INTCONbits.GIE = gie;
+  return event;
+}
@@ -0,0 +1,38 @@
+#ifndef EVENTLOG_H
+#define	EVENTLOG_H
+
+#include <stdint.h>
+
+// Must be a power of two
+#define EVENTLOG_SIZE 32
+
+// Events are stamped with the USB frame number, extended from 11 to 16 bits
+// with a count of frame number wraparounds, so stamps wrap every 65.5 s
+enum EventCode {
+  EVENT_LOG_BOOT = 0x01,          // arg: RCON at boot
+  EVENT_LOG_COMMAND = 0x02,       // arg: command
+  EVENT_LOG_STREAM_START = 0x03,  // arg: state tag
+  EVENT_LOG_STREAM_END = 0x04,    // arg: state tag
+  EVENT_LOG_STREAM_ABORT = 0x05,  // arg: state tag
+  EVENT_LOG_BLOCKED = 0x06,       // arg: blocked ticks / 10
+  EVENT_LOG_RECOVERY = 0x07,      // arg: state tag
+  EVENT_LOG_USB_RESET = 0x08,
+  EVENT_LOG_USB_SUSPEND = 0x09,
+  EVENT_LOG_USB_RESUME = 0x0A,
+};
+
+struct LoggedEvent {
+  uint8_t code;
+  uint8_t arg;
+  uint16_t frame;
+};
+
+extern void eventlog_init(void);
+extern void eventlog_sof(void);
+extern uint16_t eventlog_frame(void);
+extern void log_event(enum EventCode code, uint8_t arg);
+extern uint8_t eventlog_count(void);
+extern uint8_t eventlog_take_dropped(void);
+extern struct LoggedEvent eventlog_pop(void);
+
+#endif	/* EVENTLOG_H */
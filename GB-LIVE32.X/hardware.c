@@ -1,4 +1,5 @@
 #include "system.h"
+#include <stdbool.h>
 #include <stddef.h>
 
 #include "hardware.h"
@@ -85,6 +86,34 @@ inline void cfg_D0_7_output(void)
   TRISD = 0x00;
 }
 
+uint8_t read_eeprom(uint8_t addr)
+{
+  EEADR = addr;
+  EECON1bits.EEPGD = 0;
+  EECON1bits.CFGS = 0;
+  EECON1bits.RD = 1;
+  return EEDATA;
+}
+
+void write_eeprom(uint8_t addr, uint8_t value)
+{
+  EEADR = addr;
+  EEDATA = value;
+  EECON1bits.EEPGD = 0;
+  EECON1bits.CFGS = 0;
+  EECON1bits.WREN = 1;
+  // Required unlock sequence, which must not be interrupted
+  bool gie = INTCONbits.GIE;
+  INTCONbits.GIE = 0;
+  EECON2 = 0x55;
+  EECON2 = 0xAA;
+  EECON1bits.WR = 1;
+  INTCONbits.GIE = gie;
+  while (EECON1bits.WR) {
+  }
+  EECON1bits.WREN = 0;
+}
+
 void configure_hardware(void)
 {
   // All I/O should be digital
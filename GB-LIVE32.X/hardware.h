@@ -23,6 +23,9 @@ extern inline void write_A8_15(uint8_t value);
 extern inline void write_D0_D7(uint8_t value);
 extern inline uint8_t read_D0_D7(void);
 
+uint8_t read_eeprom(uint8_t addr);
+void write_eeprom(uint8_t addr, uint8_t value);
+
 void configure_hardware(void);
 
 #endif	/* HARDWARE_H */
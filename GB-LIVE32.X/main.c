@@ -4,10 +4,13 @@
 #include <string.h>
 
 #include "cmds.h"
+#include "eventlog.h"
 #include "hardware.h"
 #include "nelmax.h"
+#include "stamp.h"
 #include "usb.h"
 #include "usb_device_cdc.h"
+#include "vendor.h"
 
 struct NelmaX NELMAX = {{{0}}};
 
@@ -43,10 +46,13 @@ struct RxState {
 struct TxState {
   const uint8_t *buf;
   size_t remaining;
+  bool response;
 };
 
 static struct RxState rx_state = {0};
 static struct TxState tx_state = {0};
+// Command response waiting for the tail of a tx stream to be sent
+static struct TxState pending_tx = {0};
 
 struct State state = {0};
 
@@ -54,12 +60,18 @@ union Events {
   struct {
     uint8_t reset: 1;
     uint8_t sof: 1;
+    uint8_t abort: 1;
   };
   uint8_t byte;
 };
 
 static volatile union Events events;
 
+#ifdef USB_USE_VENDOR
+// Responses are sent on the interface the latest data was received from
+static bool vendor_link = false;
+#endif
+
 void reset(void)
 {
   cfg_D0_7_input();
@@ -70,10 +82,65 @@ void reset(void)
   high_GB_EN();
   rx_state.remaining = 0;
   tx_state.remaining = 0;
+  pending_tx.remaining = 0;
   events.byte = 0;
+  if (state.tag != STATE_CMD) {
+    save_stream_checkpoint();
+  }
   memset(&state, 0, sizeof(struct State));
 }
 
+// Ends any stream and discards buffered data, but keeps the other state
+void abort_stream(void)
+{
+  switch (state.tag) {
+    case STATE_RX_STREAM:
+      cfg_D0_7_input();
+      cfg_A0_15_input();
+      break;
+    case STATE_TX_STREAM:
+      high_OE();
+      cfg_A0_15_input();
+      break;
+    default:
+      break;
+  }
+  if (state.tag != STATE_CMD) {
+    log_event(EVENT_LOG_STREAM_ABORT, state.tag);
+    save_stream_checkpoint();
+    state.tag = STATE_CMD;
+  }
+  state.blocked_ticks = 0;
+  rx_state.remaining = 0;
+  tx_state.remaining = 0;
+  pending_tx.remaining = 0;
+}
+
+// Reads back a just written SRAM page and queues a verification record:
+// addr_h followed by a Fletcher-style checksum (both sums modulo 256)
+void queue_page_checksum(uint8_t addr_h)
+{
+  uint8_t sum1 = 0;
+  uint8_t sum2 = 0;
+  cfg_D0_7_input();
+  low_OE();
+  uint8_t addr_l = 0;
+  do {
+    write_A0_7(addr_l++);
+    sum1 += read_D0_D7();
+    sum2 += sum1;
+  } while (addr_l != 0);
+  high_OE();
+  cfg_D0_7_output();
+
+  tx_buffer[0] = addr_h;
+  tx_buffer[1] = sum1;
+  tx_buffer[2] = sum2;
+  tx_state.buf = tx_buffer;
+  tx_state.remaining = 3;
+  tx_state.response = false;
+}
+
 void check_blocked(void)
 {
   if (!events.sof) {
@@ -81,8 +148,16 @@ void check_blocked(void)
   }
   events.sof = false;
   state.blocked_ticks += 1;
+  // Short stalls are normal between host transfers
+  if (state.blocked_ticks == 10 || state.blocked_ticks % 100 == 0) {
+    log_event(EVENT_LOG_BLOCKED, (uint8_t)(state.blocked_ticks / 10));
+  }
   if (state.blocked_ticks > 1000) {
+    log_event(EVENT_LOG_RECOVERY, state.tag);
+    // The host resumes the stream after recovering, so it must stay unlocked
+    bool unlocked = state.unlocked;
     reset();
+    state.unlocked = unlocked;
   }
 }
 
@@ -92,9 +167,15 @@ void tick_state(void)
     events.reset = 0;
     reset();
   }
+  if (events.abort) {
+    events.abort = 0;
+    abort_stream();
+  }
   switch (state.tag) {
     case STATE_CMD: {
-      if (tx_state.remaining > 0) {
+      // Commands are accepted while stream data is still being sent, but
+      // only one response can wait for it
+      if (pending_tx.remaining > 0 || (tx_state.remaining > 0 && tx_state.response)) {
         check_blocked();
         return;
       }
@@ -108,25 +189,21 @@ void tick_state(void)
         if (nelmax_read(&NELMAX, byte, &command, &payload_size)) {
           nelmax_write(&NELMAX, dispatch_command(command, payload_size));
           state.blocked_ticks = 0;
-          tx_state.buf = nelmax_encoded_packet(&NELMAX);
-          tx_state.remaining = nelmax_encode_response(&NELMAX);
+          struct TxState *response = (tx_state.remaining > 0) ? &pending_tx : &tx_state;
+          response->buf = nelmax_encoded_packet(&NELMAX);
+          response->remaining = nelmax_encode_response(&NELMAX);
+          response->response = true;
           return;
         }
       }
       return;
     }
     case STATE_RX_STREAM: {
-      if (rx_state.remaining <= 0) {
+      if (rx_state.remaining <= 0 || (state.stream.verify && tx_state.remaining > 0)) {
         check_blocked();
         return;
       }
       state.blocked_ticks = 0;
-      if (state.stream.remaining <= 0) {
-        cfg_D0_7_input();
-        cfg_A0_15_input();
-        state.tag = STATE_CMD;
-        return;
-      }
       while (state.stream.remaining > 0 && rx_state.remaining > 0) {
         uint8_t byte = *(rx_state.buf++);
         rx_state.remaining -= 1;
@@ -139,10 +216,25 @@ void tick_state(void)
         state.stream.remaining -= 1;
         state.stream.addr_l += 1;
         if (state.stream.addr_l == 0x00) {
+          if (state.stream.verify) {
+            queue_page_checksum(state.stream.addr_h);
+          }
           state.stream.addr_h += 1;
           write_A8_15(state.stream.addr_h);
+          if (state.stream.verify) {
+            // Send the checksum before accepting more data
+            break;
+          }
         }
       }
+      if (state.stream.remaining <= 0) {
+        // End right away, so a pause before the next command isn't a stall
+        cfg_D0_7_input();
+        cfg_A0_15_input();
+        save_stream_checkpoint();
+        state.tag = STATE_CMD;
+        log_event(EVENT_LOG_STREAM_END, STATE_RX_STREAM);
+      }
       return;
     }
     case STATE_TX_STREAM: {
@@ -151,12 +243,6 @@ void tick_state(void)
         return;
       }
       state.blocked_ticks = 0;
-      if (state.stream.remaining <= 0) {
-        high_OE();
-        cfg_A0_15_input();
-        state.tag = STATE_CMD;
-        return;
-      }
       size_t len = 0;
       while (state.stream.remaining > 0 && len < CDC_DATA_IN_EP_SIZE) {
         state.stream.remaining -= 1;
@@ -170,6 +256,15 @@ void tick_state(void)
       }
       tx_state.buf = tx_buffer;
       tx_state.remaining = len;
+      tx_state.response = false;
+      if (state.stream.remaining <= 0) {
+        // Accept commands while the last chunk is being sent
+        high_OE();
+        cfg_A0_15_input();
+        save_stream_checkpoint();
+        state.tag = STATE_CMD;
+        log_event(EVENT_LOG_STREAM_END, STATE_TX_STREAM);
+      }
     }
   }
 }
@@ -179,8 +274,21 @@ void tick_rx(void)
   if (rx_state.remaining > 0) {
     return;
   }
+#ifdef USB_USE_VENDOR
+  const uint8_t *packet;
+  uint8_t len = vendor_rx(&packet);
+  if (len > 0) {
+    vendor_link = true;
+    rx_state.buf = packet;
+    rx_state.remaining = len;
+    return;
+  }
+#endif
   uint8_t remaining = getsUSBUSART(rx_buffer, CDC_DATA_OUT_EP_SIZE);
   if (remaining > 0) {
+#ifdef USB_USE_VENDOR
+    vendor_link = false;
+#endif
     rx_state.buf = rx_buffer;
     rx_state.remaining = remaining;
   }
@@ -188,13 +296,36 @@ void tick_rx(void)
 
 void tick_tx(void)
 {
-  if (tx_state.remaining <= 0 || !USBUSARTIsTxTrfReady()) {
+  if (tx_state.remaining <= 0) {
+    return;
+  }
+#ifdef USB_USE_VENDOR
+  if (vendor_link) {
+    if (!vendor_tx_ready()) {
+      return;
+    }
+    size_t chunk_len = MIN(tx_state.remaining, VENDOR_EP_SIZE);
+    vendor_tx(tx_state.buf, chunk_len);
+    tx_state.buf += chunk_len;
+    tx_state.remaining -= chunk_len;
+    if (tx_state.remaining <= 0 && pending_tx.remaining > 0) {
+      tx_state = pending_tx;
+      pending_tx.remaining = 0;
+    }
+    return;
+  }
+#endif
+  if (!USBUSARTIsTxTrfReady()) {
     return;
   }
   size_t chunk_len = MIN(tx_state.remaining, CDC_DATA_IN_EP_SIZE);
   putUSBUSART((uint8_t *) tx_state.buf, chunk_len);
   tx_state.buf += chunk_len;
   tx_state.remaining -= chunk_len;
+  if (tx_state.remaining <= 0 && pending_tx.remaining > 0) {
+    tx_state = pending_tx;
+    pending_tx.remaining = 0;
+  }
 }
 
 void main(void)
@@ -202,7 +333,11 @@ void main(void)
   state.tag = STATE_CMD;
   events.byte = 0;
   configure_hardware();
-  clear_sram(0xFF);
+  eventlog_init();
+  if (!retain_sram()) {
+    clear_sram(0xFF);
+    invalidate_stamp();
+  }
 
   USBDeviceInit();
 
@@ -257,25 +392,46 @@ bool USER_USB_CALLBACK_EVENT_HANDLER(USB_EVENT event, void *pdata, uint16_t size
   }
   switch (event) {
     case EVENT_SOF:
+      eventlog_sof();
       events.sof = true;
       return true;
     case EVENT_CONFIGURED:
       CDCInitEP();
+#ifdef USB_USE_VENDOR
+      vendor_init_ep();
+#endif
       return true;
     case EVENT_RESET:
+#ifdef USB_USE_VENDOR
+      vendor_link = false;
+#endif
       events.reset = true;
+      log_event(EVENT_LOG_USB_RESET, 0);
       return true;
     case EVENT_SUSPEND:
+      log_event(EVENT_LOG_USB_SUSPEND, 0);
       suspend();
       return true;
     case EVENT_RESUME:
       resume();
+      log_event(EVENT_LOG_USB_RESUME, 0);
       return true;
     default:
       break;
   }
   switch ((USB_DEVICE_STACK_EVENTS) event) {
     case EVENT_EP0_REQUEST:
+      // The host drops DTR to resynchronize (or when it closes the port)
+      if (SetupPkt.bmRequestType == 0x21
+          && SetupPkt.bRequest == SET_CONTROL_LINE_STATE
+          && (SetupPkt.wValue & 0x01) == 0) {
+        events.abort = true;
+      }
+#ifdef USB_USE_VENDOR
+      if (vendor_check_request()) {
+        events.abort = true;
+      }
+#endif
       USBCheckCDCRequest();
       return true;
     default:
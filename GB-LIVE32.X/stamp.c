@@ -0,0 +1,132 @@
+#include "system.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "hardware.h"
+#include "stamp.h"
+
+// Data EEPROM layout. Erased EEPROM reads as 0xFF, which must mean
+// "disabled" / "invalid"
+#define EEPROM_RETAIN 0x00
+#define EEPROM_STAMP_VALID 0x01
+#define EEPROM_STAMP_LENGTH 0x02
+#define EEPROM_STAMP_CHECKSUM 0x04
+
+#define RETAIN_ENABLED 0x5A
+#define STAMP_VALID 0xA5
+
+// Stamp of the last verified upload. It's only written to EEPROM while
+// retention is enabled, because nothing reads it from there otherwise
+struct Stamp stamp = {0};
+
+// True if the EEPROM holds a valid stamp
+static bool stamp_persisted = false;
+
+// Fletcher-style checksum of SRAM from address 0: sum2 << 16 | sum1, with
+// both sums modulo 2^16
+uint32_t sram_checksum(uint16_t length)
+{
+  uint16_t sum1 = 0;
+  uint16_t sum2 = 0;
+  cfg_A0_15_output();
+  low_OE();
+  for (uint16_t addr = 0; addr < length; addr++) {
+    if ((uint8_t) addr == 0) {
+      write_A8_15((uint8_t)(addr >> 8));
+    }
+    write_A0_7((uint8_t) addr);
+    sum1 += read_D0_D7();
+    sum2 += sum1;
+  }
+  high_OE();
+  cfg_A0_15_input();
+  return ((uint32_t) sum2 << 16) | sum1;
+}
+
+bool is_retain_enabled(void)
+{
+  return read_eeprom(EEPROM_RETAIN) == RETAIN_ENABLED;
+}
+
+static void unpersist_stamp(void)
+{
+  if (stamp_persisted) {
+    stamp_persisted = false;
+    write_eeprom(EEPROM_STAMP_VALID, 0x00);
+  }
+}
+
+static void persist_stamp(void)
+{
+  unpersist_stamp();
+  write_eeprom(EEPROM_STAMP_LENGTH, (uint8_t)(stamp.length >> 8));
+  write_eeprom(EEPROM_STAMP_LENGTH + 1, (uint8_t) stamp.length);
+  for (uint8_t i = 0; i < 4; i++) {
+    write_eeprom(EEPROM_STAMP_CHECKSUM + i, (uint8_t)(stamp.checksum >> (24 - 8 * i)));
+  }
+  // The marker is written last, so an interrupted update stays invalid
+  write_eeprom(EEPROM_STAMP_VALID, STAMP_VALID);
+  stamp_persisted = true;
+}
+
+void set_retain_enabled(bool value)
+{
+  uint8_t data = value ? RETAIN_ENABLED : 0x00;
+  if (read_eeprom(EEPROM_RETAIN) != data) {
+    write_eeprom(EEPROM_RETAIN, data);
+  }
+  if (value && stamp.valid && !stamp_persisted) {
+    persist_stamp();
+  } else if (!value) {
+    unpersist_stamp();
+  }
+}
+
+static void load_stamp(void)
+{
+  stamp.valid = read_eeprom(EEPROM_STAMP_VALID) == STAMP_VALID;
+  stamp_persisted = stamp.valid;
+  stamp.length = ((uint16_t) read_eeprom(EEPROM_STAMP_LENGTH) << 8)
+    | read_eeprom(EEPROM_STAMP_LENGTH + 1);
+  stamp.checksum = 0;
+  for (uint8_t i = 0; i < 4; i++) {
+    stamp.checksum = (stamp.checksum << 8) | read_eeprom(EEPROM_STAMP_CHECKSUM + i);
+  }
+  if (stamp.length == 0 || stamp.length > 0x8000) {
+    stamp.valid = false;
+  }
+}
+
+void invalidate_stamp(void)
+{
+  stamp.valid = false;
+  unpersist_stamp();
+}
+
+void store_stamp(uint16_t length, uint32_t checksum)
+{
+  stamp.valid = true;
+  stamp.length = length;
+  stamp.checksum = checksum;
+  if (is_retain_enabled()) {
+    persist_stamp();
+  } else {
+    unpersist_stamp();
+  }
+}
+
+// Called at boot: returns true if retention is enabled and SRAM still holds
+// the stamped image. SRAM contents don't survive a power loss, so the stamp
+// is checked against the actual contents
+bool retain_sram(void)
+{
+  load_stamp();
+  if (!stamp.valid) {
+    return false;
+  }
+  if (!is_retain_enabled() || sram_checksum(stamp.length) != stamp.checksum) {
+    invalidate_stamp();
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,22 @@
+#ifndef STAMP_H
+#define	STAMP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct Stamp {
+  bool valid;
+  uint16_t length;
+  uint32_t checksum;
+};
+
+extern struct Stamp stamp;
+
+extern uint32_t sram_checksum(uint16_t length);
+extern bool is_retain_enabled(void);
+extern void set_retain_enabled(bool value);
+extern void invalidate_stamp(void);
+extern void store_stamp(uint16_t length, uint32_t checksum);
+extern bool retain_sram(void);
+
+#endif	/* STAMP_H */
@@ -17,8 +17,16 @@
 #define OUT_DATA_BUFFER_ADDRESS_TAG __at(0x540)
 #define CONTROL_BUFFER_ADDRESS_TAG  __at(0x580)
 
+// Comment out to build a CDC-only firmware
+#define USB_USE_VENDOR
+
+#ifdef USB_USE_VENDOR
+#define USB_MAX_EP_NUMBER 3
+#define USB_MAX_NUM_INT 3
+#else
 #define USB_MAX_EP_NUMBER 2
 #define USB_MAX_NUM_INT 2
+#endif
 
 #define USB_EP0_BUFF_SIZE 64
 #define USB_NUM_STRING_DESCRIPTORS 3
@@ -35,4 +43,12 @@
 #define CDC_DATA_OUT_EP_SIZE 64
 #define CDC_DATA_IN_EP_SIZE 64
 
+// Vendor-specific bulk interface that carries the same protocol as the CDC
+// data interface without going through the host tty layer
+#define VENDOR_INTF_ID 2
+#define VENDOR_EP 3
+#define VENDOR_EP_SIZE 64
+#define VENDOR_OUT_BUFFER_ADDRESS_TAG __at(0x5C0)
+#define VENDOR_IN_BUFFER_ADDRESS_TAG __at(0x640)
+
 #endif /* USB_CONFIG_H__ */
@@ -18,13 +18,21 @@ const USB_DEVICE_DESCRIPTOR device_dsc = {
   sizeof(device_dsc), // bLength
   USB_DESCRIPTOR_DEVICE, // bDescriptorType
   0x0200, // bcdUSB, 0x0200 = USB 2.0
+#ifdef USB_USE_VENDOR
+  // Miscellaneous/IAD, so Windows loads the composite driver and WinUSB can
+  // bind to the vendor interface
+  0xEF, // bDeviceClass
+  0x02, // bDeviceSubClass
+  0x01, // bDeviceProtocol
+#else
   0x02, // bDeviceClass
   0x00, // bDeviceSubClass
   0x00, // bDeviceProtocol
+#endif
   USB_EP0_BUFF_SIZE, // bMaxPacketSize0
   0x16C0, // Vendor
   0x05E1, // Product
-  0x0201, // device release (2.1)
+  0x0202, // device release (2.2)
   1, // Manufacturer
   2, // Product
   0, // Serial
@@ -43,6 +51,11 @@ struct Configuration1 {
   USB_INTERFACE_DESCRIPTOR cdc_data_interface;
   USB_ENDPOINT_DESCRIPTOR cdc_data_out;
   USB_ENDPOINT_DESCRIPTOR cdc_data_in;
+#ifdef USB_USE_VENDOR
+  USB_INTERFACE_DESCRIPTOR vendor_interface;
+  USB_ENDPOINT_DESCRIPTOR vendor_out;
+  USB_ENDPOINT_DESCRIPTOR vendor_in;
+#endif
 };
 
 static const struct Configuration1 configuration_1 = {
@@ -50,7 +63,7 @@ static const struct Configuration1 configuration_1 = {
     sizeof(USB_CONFIGURATION_DESCRIPTOR), // bLength
     USB_DESCRIPTOR_CONFIGURATION, // bDescriptorType
     sizeof(struct Configuration1), // wTotalLength
-    2, // bNumInterfaces
+    USB_MAX_NUM_INT, // bNumInterfaces
     1, // bConfigurationValue
     0, // iConfiguration
     USB_CFG_DSC_REQUIRED, // bmAttributes
@@ -131,6 +144,35 @@ static const struct Configuration1 configuration_1 = {
     CDC_DATA_OUT_EP_SIZE, // wMaxPacketSize
     1, // bInterval
   },
+#ifdef USB_USE_VENDOR
+  {
+    sizeof(USB_INTERFACE_DESCRIPTOR), // bLength
+    USB_DESCRIPTOR_INTERFACE, // bDescriptorType
+    VENDOR_INTF_ID, // bInterfaceNumber
+    0, // bAlternateSetting
+    2, // bNumEndpoints
+    0xFF, // bInterfaceClass (vendor-specific)
+    0, // bInterfaceSubClass
+    0, // bInterfaceProtocol
+    0, // iInterface
+  },
+  {
+    sizeof(USB_ENDPOINT_DESCRIPTOR), // bLength
+    USB_DESCRIPTOR_ENDPOINT, // bDescriptorType
+    _EP03_OUT, // bEndpointAddress
+    _BULK, // bmAttributes
+    VENDOR_EP_SIZE, // wMaxPacketSize
+    1, // bInterval
+  },
+  {
+    sizeof(USB_ENDPOINT_DESCRIPTOR), // bLength
+    USB_DESCRIPTOR_ENDPOINT, // bDescriptorType
+    _EP03_IN, // bEndpointAddress
+    _BULK, // bmAttributes
+    VENDOR_EP_SIZE, // wMaxPacketSize
+    1, // bInterval
+  },
+#endif
 };
 
 const uint8_t *const USB_CD_Ptr[] = {
@@ -0,0 +1,79 @@
+#include "system.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "usb.h"
+#include "vendor.h"
+
+#ifdef USB_USE_VENDOR
+
+// Two buffers per direction, so the SIE can fill or drain one ping-pong
+// buffer while the firmware works with the other one
+static uint8_t rx_packets[2][VENDOR_EP_SIZE] VENDOR_OUT_BUFFER_ADDRESS_TAG;
+static uint8_t tx_packets[2][VENDOR_EP_SIZE] VENDOR_IN_BUFFER_ADDRESS_TAG;
+
+static USB_HANDLE rx_handles[2];
+static USB_HANDLE tx_handles[2];
+static uint8_t rx_next;
+static uint8_t tx_next;
+// Buffer returned by the previous vendor_rx call, re-armed on the next call
+static int8_t rx_consumed = -1;
+
+void vendor_init_ep(void)
+{
+  USBEnableEndpoint(VENDOR_EP, USB_OUT_ENABLED | USB_IN_ENABLED | USB_HANDSHAKE_ENABLED | USB_DISALLOW_SETUP);
+  rx_handles[0] = USBRxOnePacket(VENDOR_EP, rx_packets[0], VENDOR_EP_SIZE);
+  rx_handles[1] = USBRxOnePacket(VENDOR_EP, rx_packets[1], VENDOR_EP_SIZE);
+  tx_handles[0] = 0;
+  tx_handles[1] = 0;
+  rx_next = 0;
+  tx_next = 0;
+  rx_consumed = -1;
+}
+
+// Returns true if the current EP0 request was an abort request
+bool vendor_check_request(void)
+{
+  if (SetupPkt.bmRequestType != 0x41 || SetupPkt.wIndex != VENDOR_INTF_ID) {
+    return false;
+  }
+  switch (SetupPkt.bRequest) {
+    case VENDOR_REQUEST_ABORT:
+      USBEP0Transmit(USB_EP0_NO_DATA);
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Returns the length of the next received packet, and points buf at its
+// data. The data stays valid until the next call
+uint8_t vendor_rx(const uint8_t **buf)
+{
+  if (rx_consumed >= 0) {
+    rx_handles[rx_consumed] = USBRxOnePacket(VENDOR_EP, rx_packets[rx_consumed], VENDOR_EP_SIZE);
+    rx_consumed = -1;
+  }
+  if (USBHandleBusy(rx_handles[rx_next])) {
+    return 0;
+  }
+  *buf = rx_packets[rx_next];
+  rx_consumed = (int8_t) rx_next;
+  rx_next ^= 1;
+  return (uint8_t) USBHandleGetLength(rx_handles[rx_consumed]);
+}
+
+bool vendor_tx_ready(void)
+{
+  return !USBHandleBusy(tx_handles[tx_next]);
+}
+
+void vendor_tx(const uint8_t *data, uint8_t len)
+{
+  memcpy(tx_packets[tx_next], data, len);
+  tx_handles[tx_next] = USBTxOnePacket(VENDOR_EP, tx_packets[tx_next], len);
+  tx_next ^= 1;
+}
+
+#endif
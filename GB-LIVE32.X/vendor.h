@@ -0,0 +1,23 @@
+#ifndef VENDOR_H
+#define	VENDOR_H
+
+#include "usb_config.h"
+
+#ifdef USB_USE_VENDOR
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Control request (bmRequestType 0x41, wIndex = VENDOR_INTF_ID) that aborts
+// any in-progress stream, like dropping DTR does on the CDC interface
+#define VENDOR_REQUEST_ABORT 0x01
+
+extern void vendor_init_ep(void);
+extern bool vendor_check_request(void);
+extern uint8_t vendor_rx(const uint8_t **buf);
+extern bool vendor_tx_ready(void);
+extern void vendor_tx(const uint8_t *data, uint8_t len);
+
+#endif
+
+#endif	/* VENDOR_H */
@@ -0,0 +1,229 @@
+use anyhow::{bail, Error};
+use gb_live32::{Gbl32, Gbl32Error};
+use log::{info, warn};
+use rand::{rngs::SmallRng, RngCore, SeedableRng};
+use std::time::{Duration, Instant};
+
+#[derive(Clone, Debug)]
+pub struct BenchConfig {
+    /// Number of pings and status queries
+    pub iterations: usize,
+    /// Number of block passes over all of SRAM, and of each stream type
+    pub passes: usize,
+}
+
+#[derive(Default)]
+struct Samples {
+    durations: Vec<Duration>,
+}
+
+impl Samples {
+    fn measure<T>(&mut self, f: impl FnOnce() -> Result<T, Gbl32Error>) -> Result<T, Gbl32Error> {
+        let start = Instant::now();
+        let result = f()?;
+        self.durations.push(start.elapsed());
+        Ok(result)
+    }
+    fn report(&mut self, name: &str, command: &str) {
+        if self.durations.is_empty() {
+            return;
+        }
+        self.durations.sort();
+        let percentile = |p: usize| self.durations[(self.durations.len() - 1) * p / 100];
+        info!(
+            "{}: {}: n={}, p50={:?}, p95={:?}, p99={:?}, max={:?}",
+            name,
+            command,
+            self.durations.len(),
+            percentile(50),
+            percentile(95),
+            percentile(99),
+            percentile(100)
+        );
+        // Histogram with power-of-two microsecond buckets
+        let mut buckets: Vec<(u32, usize)> = Vec::new();
+        for duration in &self.durations {
+            let micros = duration.as_micros().max(1) as u64;
+            let bucket = 64 - (micros - 1).leading_zeros();
+            match buckets.last_mut() {
+                Some((last, count)) if *last == bucket => *count += 1,
+                _ => buckets.push((bucket, 1)),
+            }
+        }
+        for (bucket, count) in buckets {
+            info!(
+                "{}: {}:   <= {:?}: {}",
+                name,
+                command,
+                Duration::from_micros(1 << bucket),
+                count
+            );
+        }
+    }
+    fn report_throughput(&self, name: &str, command: &str, bytes: usize) {
+        let total: Duration = self.durations.iter().sum();
+        if total.is_zero() {
+            return;
+        }
+        let rate = (bytes * self.durations.len()) as f64 / total.as_secs_f64();
+        info!(
+            "{}: {}: {:.1} KiB/s sustained",
+            name,
+            command,
+            rate / 1024.0
+        );
+    }
+}
+
+/// Runs a fixed workload and reports latencies per command.
+///
+/// SRAM contents are overwritten, and the previous pass-through and reset
+/// states are restored afterwards, even if the benchmark fails. Data read
+/// back is compared with what was written, so corruption fails the run.
+pub fn run(
+    name: &str,
+    gbl32: &mut Gbl32,
+    version: (u8, u8),
+    config: &BenchConfig,
+) -> Result<(), Error> {
+    let status = gbl32.get_status()?;
+    let result = gbl32
+        .set_reset(true)
+        .and_then(|_| gbl32.set_passthrough(false))
+        .map_err(Error::from)
+        .and_then(|_| workload(name, gbl32, version, config));
+    if result.is_err() {
+        // A failed stream may have left the session out of sync
+        let _ = gbl32.resync();
+    }
+    let restored = gbl32
+        .set_passthrough(status.passthrough)
+        .and_then(|_| gbl32.set_reset(status.reset));
+    match (result, restored) {
+        (Err(e), Err(restore)) => {
+            warn!(
+                "{}: Failed to restore the cartridge state: {}",
+                name, restore
+            );
+            Err(e)
+        }
+        (result, restored) => result.and(restored.map_err(Error::from)),
+    }
+}
+
+/// Fails if `actual`, read from SRAM at `start`, differs from `expected`
+fn check_data(
+    name: &str,
+    command: &str,
+    start: usize,
+    expected: &[u8],
+    actual: &[u8],
+) -> Result<(), Error> {
+    match expected.iter().zip(actual).position(|(a, b)| a != b) {
+        Some(idx) => bail!(
+            "{}: {} returned corrupted data at {:04x}",
+            name,
+            command,
+            start + idx
+        ),
+        None if expected.len() != actual.len() => bail!(
+            "{}: {} returned {} bytes, expected {}",
+            name,
+            command,
+            actual.len(),
+            expected.len()
+        ),
+        None => Ok(()),
+    }
+}
+
+fn workload(
+    name: &str,
+    gbl32: &mut Gbl32,
+    version: (u8, u8),
+    config: &BenchConfig,
+) -> Result<(), Error> {
+    let mut rng = SmallRng::from_entropy();
+    info!(
+        "{}: Benchmarking firmware v{}.{} ({} iterations, {} passes)",
+        name, version.0, version.1, config.iterations, config.passes
+    );
+
+    let mut samples = Samples::default();
+    let mut handshake = [0; 8];
+    for _ in 0..config.iterations {
+        rng.fill_bytes(&mut handshake);
+        samples.measure(|| gbl32.ping(&handshake))?;
+    }
+    samples.report(name, "ping");
+
+    let mut samples = Samples::default();
+    for _ in 0..config.iterations {
+        samples.measure(|| gbl32.get_version())?;
+    }
+    samples.report(name, "get_version");
+
+    let mut samples = Samples::default();
+    for _ in 0..config.iterations {
+        samples.measure(|| gbl32.get_status())?;
+    }
+    samples.report(name, "get_status");
+
+    let mut data = vec![0; 0x8000];
+    rng.fill_bytes(&mut data);
+
+    let mut samples = Samples::default();
+    for _ in 0..config.passes {
+        for (addr_h, block) in data.chunks(0x100).enumerate() {
+            samples.measure(|| gbl32.write_block(addr_h as u8, block))?;
+        }
+    }
+    samples.report(name, "write_block");
+    samples.report_throughput(name, "write_block", 0x100);
+
+    let mut samples = Samples::default();
+    for _ in 0..config.passes {
+        for addr_h in 0..0x80 {
+            let block = samples.measure(|| gbl32.read_block(addr_h))?;
+            let start = (addr_h as usize) << 8;
+            check_data(
+                name,
+                "read_block",
+                start,
+                &data[start..start + 0x100],
+                block,
+            )?;
+        }
+    }
+    samples.report(name, "read_block");
+    samples.report_throughput(name, "read_block", 0x100);
+
+    let mut samples = Samples::default();
+    for _ in 0..config.passes {
+        // The status query waits until the firmware has consumed the stream
+        samples.measure(|| {
+            gbl32.write_all(&data)?;
+            gbl32.get_status().map(|_| ())
+        })?;
+    }
+    samples.report(name, "write_all");
+    samples.report_throughput(name, "write_all", 0x8000);
+
+    if version >= (2, 2) {
+        let mut samples = Samples::default();
+        for _ in 0..config.passes {
+            samples.measure(|| gbl32.write_all_verified(&data))?;
+        }
+        samples.report(name, "write_all_verified");
+        samples.report_throughput(name, "write_all_verified", 0x8000);
+    }
+
+    let mut samples = Samples::default();
+    for _ in 0..config.passes {
+        let read = samples.measure(|| gbl32.read_all())?;
+        check_data(name, "read_all", 0, &data, &read)?;
+    }
+    samples.report(name, "read_all");
+    samples.report_throughput(name, "read_all", 0x8000);
+    Ok(())
+}
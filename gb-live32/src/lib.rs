@@ -1,11 +1,25 @@
 use bufstream::BufStream;
+use log::warn;
 use rand::{rngs::SmallRng, RngCore, SeedableRng};
-use serialport::SerialPort;
+use serialport::{ClearBuffer, SerialPort};
 use std::{
     io::{self, BufRead, Read, Write},
-    time::Duration,
+    mem, thread,
+    time::{Duration, Instant},
 };
 
+use crate::{
+    sram::{SramReader, SramWriter},
+    timeline::{EventLog, EVENT_LOG_SIZE},
+    trace::{Direction, EventKind, TraceEvent, TraceRecorder},
+};
+
+pub mod schedule;
+pub mod sram;
+pub mod timeline;
+pub mod trace;
+pub mod usb;
+
 #[derive(thiserror::Error, Debug)]
 pub enum Gbl32Error {
     #[error("Handshake failed")]
@@ -20,10 +34,114 @@ pub enum Gbl32Error {
     Io(#[source] io::Error),
 }
 
+impl Gbl32Error {
+    /// Returns true if the error may be caused by a stalled or interrupted
+    /// connection, and retrying after recovery might succeed
+    pub fn is_transient(&self) -> bool {
+        match self {
+            Gbl32Error::Decode => true,
+            Gbl32Error::Io(e) => matches!(
+                e.kind(),
+                io::ErrorKind::TimedOut | io::ErrorKind::UnexpectedEof
+            ),
+            _ => false,
+        }
+    }
+}
+
+/// Controls how interrupted 32 KB streams are resumed.
+///
+/// After a failure the session is resynchronized, which makes the firmware
+/// abort the stream and record its position as a checkpoint. Resuming
+/// requires firmware v2.2 or later.
+#[derive(Debug, Copy, Clone, Default, Eq, PartialEq)]
+pub struct RetryPolicy {
+    /// Maximum number of times a single stream is resumed (0 = fail immediately)
+    pub max_retries: u32,
+}
+
+/// Checksum record the firmware sends after writing a page in a verified stream
+fn page_checksum(addr_h: u8, page: &[u8]) -> [u8; 3] {
+    let (sum1, sum2) = page.iter().fold((0u8, 0u8), |(sum1, sum2), &byte| {
+        let sum1 = sum1.wrapping_add(byte);
+        (sum1, sum2.wrapping_add(sum1))
+    });
+    [addr_h, sum1, sum2]
+}
+
+/// Byte stream connection to a device
+pub trait Transport: Read + Write + Send {
+    fn set_timeout(&mut self, timeout: Duration) -> io::Result<()>;
+    /// Discards all pending input and output
+    fn clear(&mut self) -> io::Result<()>;
+    fn try_clone(&self) -> io::Result<Box<dyn Transport>>;
+    /// Signals the device out of band to abort any in-progress stream
+    fn abort(&mut self) -> io::Result<()>;
+}
+
+fn serial_io_error(e: serialport::Error) -> io::Error {
+    io::Error::other(e)
+}
+
+impl Transport for Box<dyn SerialPort> {
+    fn set_timeout(&mut self, timeout: Duration) -> io::Result<()> {
+        SerialPort::set_timeout(self.as_mut(), timeout).map_err(serial_io_error)
+    }
+    fn clear(&mut self) -> io::Result<()> {
+        SerialPort::clear(self.as_ref(), ClearBuffer::All).map_err(serial_io_error)
+    }
+    fn try_clone(&self) -> io::Result<Box<dyn Transport>> {
+        let port = SerialPort::try_clone(self.as_ref()).map_err(serial_io_error)?;
+        Ok(Box::new(port))
+    }
+    fn abort(&mut self) -> io::Result<()> {
+        // Firmware v2.2 aborts streams when DTR is dropped
+        self.write_data_terminal_ready(false)
+            .and_then(|_| self.write_data_terminal_ready(true))
+            .map_err(serial_io_error)
+    }
+}
+
+/// Stands in for the transport while stale buffers are dropped
+struct Detached;
+
+impl Read for Detached {
+    fn read(&mut self, _: &mut [u8]) -> io::Result<usize> {
+        Ok(0)
+    }
+}
+
+impl Write for Detached {
+    fn write(&mut self, buf: &[u8]) -> io::Result<usize> {
+        Ok(buf.len())
+    }
+    fn flush(&mut self) -> io::Result<()> {
+        Ok(())
+    }
+}
+
+impl Transport for Detached {
+    fn set_timeout(&mut self, _: Duration) -> io::Result<()> {
+        Ok(())
+    }
+    fn clear(&mut self) -> io::Result<()> {
+        Ok(())
+    }
+    fn try_clone(&self) -> io::Result<Box<dyn Transport>> {
+        Ok(Box::new(Detached))
+    }
+    fn abort(&mut self) -> io::Result<()> {
+        Ok(())
+    }
+}
+
 pub struct Gbl32 {
-    port: BufStream<Box<dyn SerialPort>>,
+    port: BufStream<Box<dyn Transport>>,
     read_buffer: Vec<u8>,
     write_buffer: Box<[u8]>,
+    retry_policy: RetryPolicy,
+    trace: Option<TraceRecorder>,
+    connect_latency: Duration,
 }
 
 #[derive(Debug, Copy, Clone, Eq, PartialEq)]
@@ -33,36 +151,162 @@ pub struct Status {
     pub reset: bool,
 }
 
+/// Identifies the image in SRAM by its length and a Fletcher-style checksum
+/// from address 0, computed the same way as the firmware does
+#[derive(Debug, Copy, Clone, Eq, PartialEq)]
+pub struct Stamp {
+    pub length: u16,
+    pub checksum: u32,
+}
+
+impl Stamp {
+    pub fn for_image(data: &[u8]) -> Stamp {
+        assert!(data.len() <= 0x8000);
+        let (sum1, sum2) = data.iter().fold((0u16, 0u16), |(sum1, sum2), &byte| {
+            let sum1 = sum1.wrapping_add(byte as u16);
+            (sum1, sum2.wrapping_add(sum1))
+        });
+        Stamp {
+            length: data.len() as u16,
+            checksum: (sum2 as u32) << 16 | sum1 as u32,
+        }
+    }
+}
+
+/// SRAM retention settings, stored in the firmware's data EEPROM
+#[derive(Debug, Copy, Clone, Eq, PartialEq)]
+pub struct Retention {
+    /// SRAM is not cleared at boot if it still matches the stamp
+    pub enabled: bool,
+    /// Stamp of the last verified upload, if SRAM hasn't been written since
+    pub stamp: Option<Stamp>,
+}
+
 impl Gbl32 {
-    pub fn from_port(mut port: Box<dyn SerialPort>) -> Result<Gbl32, Gbl32Error> {
-        port.set_timeout(Duration::from_millis(200))
-            .map_err(Gbl32Error::Serial)?;
+    pub fn from_port(port: Box<dyn SerialPort>) -> Result<Gbl32, Gbl32Error> {
+        Gbl32::from_transport(Box::new(port))
+    }
+    pub fn from_transport(transport: Box<dyn Transport>) -> Result<Gbl32, Gbl32Error> {
+        Gbl32::from_transport_traced(transport, None)
+    }
+    /// Like `from_transport`, but records all traffic into `trace` from the
+    /// start, including the connection handshake
+    pub fn from_transport_traced(
+        mut transport: Box<dyn Transport>,
+        trace: Option<TraceRecorder>,
+    ) -> Result<Gbl32, Gbl32Error> {
+        transport
+            .set_timeout(Duration::from_millis(200))
+            .map_err(Gbl32Error::Io)?;
         let mut gbl32 = Gbl32 {
-            port: BufStream::new(port),
+            port: BufStream::new(transport),
             read_buffer: Vec::new(),
             write_buffer: vec![0; 1024].into_boxed_slice(),
+            retry_policy: RetryPolicy::default(),
+            trace,
+            connect_latency: Duration::ZERO,
         };
+        gbl32.connect_latency = gbl32.resync()?;
+        Ok(gbl32)
+    }
+    /// Returns how long the initial resynchronization took
+    pub fn connect_latency(&self) -> Duration {
+        self.connect_latency
+    }
+    pub fn retry_policy(&self) -> RetryPolicy {
+        self.retry_policy
+    }
+    pub fn set_retry_policy(&mut self, policy: RetryPolicy) {
+        self.retry_policy = policy;
+    }
+    /// Starts recording all traffic into `trace`, or stops recording if `None`
+    pub fn set_trace(&mut self, trace: Option<TraceRecorder>) {
+        self.trace = trace;
+    }
+    fn record(
+        &mut self,
+        direction: Direction,
+        kind: EventKind,
+        data: &[u8],
+    ) -> Result<(), Gbl32Error> {
+        self.record_at(Instant::now(), direction, kind, data)
+    }
+    fn record_at(
+        &mut self,
+        at: Instant,
+        direction: Direction,
+        kind: EventKind,
+        data: &[u8],
+    ) -> Result<(), Gbl32Error> {
+        match self.trace {
+            Some(ref mut trace) => trace
+                .record_at(at, direction, kind, data)
+                .map_err(Gbl32Error::Io),
+            None => Ok(()),
+        }
+    }
+    /// Replays the host side of a trace recorded with `set_trace`, and
+    /// compares the device response timing against the recording
+    pub fn replay(&mut self, events: &[TraceEvent]) -> Result<trace::ReplayReport, Gbl32Error> {
+        trace::replay(&mut self.port, events).map_err(Gbl32Error::Io)
+    }
+    fn handshake(&mut self) -> Result<(), Gbl32Error> {
         let mut rng = SmallRng::from_entropy();
         let mut handshake = vec![0; 8];
         let mut errors = 0;
+        let mut pending = false;
         loop {
-            rng.fill_bytes(&mut handshake);
-            match gbl32.ping(&handshake) {
-                Ok(success) => {
-                    if success {
-                        break;
-                    }
+            let result = if pending {
+                self.read_response(0x01, 8)
+                    .map(|response| response == handshake)
+            } else {
+                rng.fill_bytes(&mut handshake);
+                pending = true;
+                self.ping(&handshake)
+            };
+            match result {
+                Ok(true) => break,
+                // A stale or corrupt frame. The response to the ping may be
+                // queued behind it, so read on instead of pinging again
+                Ok(false) | Err(Gbl32Error::Decode) | Err(Gbl32Error::Protocol(_)) => errors += 1,
+                Err(Gbl32Error::Io(ref e)) if e.kind() == io::ErrorKind::TimedOut => {
                     errors += 1;
+                    pending = false;
                 }
-                Err(Gbl32Error::Decode) | Err(Gbl32Error::Protocol(_)) => errors += 1,
-                Err(Gbl32Error::Io(ref e)) if e.kind() == io::ErrorKind::TimedOut => errors += 1,
                 Err(e) => return Err(e),
             }
             if errors > 10 {
                 return Err(Gbl32Error::Handshake);
             }
         }
-        Ok(gbl32)
+        Ok(())
+    }
+    /// Brings the session into a known state without waiting for timeouts.
+    ///
+    /// Any in-progress stream is aborted, unsent output and stale input are
+    /// discarded, and a frame delimiter resets the decoder state in the
+    /// firmware before the ping handshake. Stale responses are skipped
+    /// without sending another ping. Returns the time it took.
+    pub fn resync(&mut self) -> Result<Duration, Gbl32Error> {
+        let start = Instant::now();
+        self.discard_buffers();
+        self.record(Direction::ToDevice, EventKind::Abort, &[])?;
+        self.port.get_mut().abort().map_err(Gbl32Error::Io)?;
+        // Let IN packets that were already in flight arrive, so they're cleared
+        thread::sleep(Duration::from_millis(1));
+        self.port.get_mut().clear().map_err(Gbl32Error::Io)?;
+        self.record(Direction::ToDevice, EventKind::Frame, &[0x00])?;
+        self.port.write_all(&[0x00]).map_err(Gbl32Error::Io)?;
+        self.port.flush().map_err(Gbl32Error::Io)?;
+        self.handshake()?;
+        Ok(start.elapsed())
+    }
+    /// Drops data buffered in either direction without sending it, because
+    /// it belongs to an interrupted exchange
+    fn discard_buffers(&mut self) {
+        let transport = mem::replace(self.port.get_mut(), Box::new(Detached));
+        // Dropping the old stream flushes its write buffer into `Detached`
+        self.port = BufStream::new(transport);
     }
     fn request_response(
         &mut self,
@@ -75,15 +319,32 @@ impl Gbl32 {
 
         let encoded_len = cobs::encode(&payload, &mut self.write_buffer);
         self.write_buffer[encoded_len] = 0x00;
+        if let Some(ref mut trace) = self.trace {
+            trace
+                .record(
+                    Direction::ToDevice,
+                    EventKind::Frame,
+                    &self.write_buffer[0..(encoded_len + 1)],
+                )
+                .map_err(Gbl32Error::Io)?;
+        }
         self.port
             .write_all(&self.write_buffer[0..(encoded_len + 1)])
             .map_err(Gbl32Error::Io)?;
         self.port.flush().map_err(Gbl32Error::Io)?;
-
+        self.read_response(cmd, expected_len)
+    }
+    /// Reads and checks the next response frame
+    fn read_response(&mut self, cmd: u8, expected_len: usize) -> Result<&[u8], Gbl32Error> {
         self.read_buffer.clear();
         self.port
             .read_until(0x00, &mut self.read_buffer)
             .map_err(Gbl32Error::Io)?;
+        if let Some(ref mut trace) = self.trace {
+            trace
+                .record(Direction::FromDevice, EventKind::Frame, &self.read_buffer)
+                .map_err(Gbl32Error::Io)?;
+        }
         self.read_buffer.pop();
 
         let decoded_len =
@@ -173,22 +434,257 @@ impl Gbl32 {
         self.request_response(0x08, &payload, 0)?;
         Ok(())
     }
-    pub fn write_all(&mut self, data: &[u8]) -> Result<(), Gbl32Error> {
-        if data.len() != 0x8000 {
+    pub fn stream_checkpoint(&mut self) -> Result<u16, Gbl32Error> {
+        let data = self.request_response(0x0b, &[], 2)?;
+        Ok(u16::from_be_bytes([data[0], data[1]]))
+    }
+    pub fn get_retention(&mut self) -> Result<Retention, Gbl32Error> {
+        let data = self.request_response(0x0e, &[], 8)?;
+        Ok(Retention {
+            enabled: data[0] != 0x00,
+            stamp: if data[1] != 0x00 {
+                Some(Stamp {
+                    length: u16::from_be_bytes([data[2], data[3]]),
+                    checksum: u32::from_be_bytes([data[4], data[5], data[6], data[7]]),
+                })
+            } else {
+                None
+            },
+        })
+    }
+    pub fn set_retain(&mut self, value: bool) -> Result<(), Gbl32Error> {
+        self.request_response(0x0f, &[value as u8], 0)?;
+        Ok(())
+    }
+    /// Stores `stamp` for the image in SRAM. The firmware rejects the stamp
+    /// if it doesn't match the actual SRAM contents
+    pub fn set_stamp(&mut self, stamp: Stamp) -> Result<(), Gbl32Error> {
+        let mut payload = Vec::with_capacity(6);
+        payload.extend(stamp.length.to_be_bytes());
+        payload.extend(stamp.checksum.to_be_bytes());
+        self.request_response(0x0d, &payload, 0)?;
+        Ok(())
+    }
+    /// Takes all events from the device event log
+    pub fn drain_events(&mut self) -> Result<EventLog, Gbl32Error> {
+        let data = self.request_response(0x10, &[], 4 + 4 * EVENT_LOG_SIZE)?;
+        Ok(EventLog::parse(data))
+    }
+    /// Starts a stream command covering `len` bytes from `offset`
+    fn start_stream(&mut self, cmd: u8, offset: u16, len: usize) -> Result<(), Gbl32Error> {
+        if offset >= 0x8000 || len == 0 || len > 0x8000 - offset as usize {
             return Err(Gbl32Error::Protocol(format!(
-                "Expected 32768 bytes for writing, got {}",
-                data.len()
+                "Invalid stream range {:04x}+{:04x}",
+                offset, len
             )));
         }
-        self.request_response(0x09, &[], 0)?;
+        let mut payload = Vec::with_capacity(4);
+        if offset != 0 || len != 0x8000 {
+            payload.extend(offset.to_be_bytes());
+        }
+        if offset as usize + len != 0x8000 {
+            payload.extend((len as u16).to_be_bytes());
+        }
+        self.request_response(cmd, &payload, 0)?;
+        Ok(())
+    }
+    /// Reads raw stream data from an active TX stream
+    fn read_stream(&mut self, buf: &mut [u8]) -> Result<usize, Gbl32Error> {
+        loop {
+            match self.port.read(buf) {
+                Ok(0) => return Err(Gbl32Error::Io(io::ErrorKind::UnexpectedEof.into())),
+                Ok(len) => {
+                    self.record(Direction::FromDevice, EventKind::Stream, &buf[..len])?;
+                    return Ok(len);
+                }
+                Err(ref e) if e.kind() == io::ErrorKind::Interrupted => (),
+                Err(e) => return Err(Gbl32Error::Io(e)),
+            }
+        }
+    }
+    /// Streams `data` to SRAM starting from `offset`
+    pub fn write_from(&mut self, offset: u16, data: &[u8]) -> Result<(), Gbl32Error> {
+        self.start_stream(0x09, offset, data.len())?;
+        self.send_stream(data)
+    }
+    /// Sends the data of an RX stream the firmware has accepted
+    fn send_stream(&mut self, data: &[u8]) -> Result<(), Gbl32Error> {
+        self.record(Direction::ToDevice, EventKind::Stream, data)?;
         self.port.write_all(data).map_err(Gbl32Error::Io)?;
         self.port.flush().map_err(Gbl32Error::Io)?;
         Ok(())
     }
+    /// Streams SRAM starting from `offset` into `buf`.
+    ///
+    /// `received` is advanced as data arrives, so it is valid even on errors
+    pub fn read_from(
+        &mut self,
+        offset: u16,
+        buf: &mut [u8],
+        received: &mut usize,
+    ) -> Result<(), Gbl32Error> {
+        self.start_stream(0x0a, offset, buf.len())?;
+        while *received < buf.len() {
+            *received += self.read_stream(&mut buf[*received..])?;
+        }
+        Ok(())
+    }
+    /// Sends `image` from `offset` for an accepted verified RX stream, and
+    /// checks the page checksums the firmware sends back after writing each
+    /// page.
+    ///
+    /// The checksums are read on a separate thread using a cloned transport,
+    /// so verification overlaps with the upload instead of needing a
+    /// separate read stream. Requires firmware v2.2 or later.
+    ///
+    /// `verified` is set to the number of pages whose checksum matched, so
+    /// it is valid even on errors
+    fn send_verified_stream(
+        &mut self,
+        offset: u16,
+        image: &[u8],
+        verified: &mut usize,
+    ) -> Result<(), Gbl32Error> {
+        let mut reader = self.port.get_ref().try_clone().map_err(Gbl32Error::Io)?;
+        let data = &image[offset as usize..];
+        self.record(Direction::ToDevice, EventKind::Stream, data)?;
+
+        let first_page = (offset >> 8) as u8;
+        let (written, checked) = thread::scope(|scope| {
+            // This thread is busy writing, so the checker notes when each
+            // record arrived, and they are traced after the upload
+            let checker = scope.spawn(move || {
+                let mut records = Vec::new();
+                for addr_h in first_page..0x80 {
+                    let page = &image[(addr_h as usize) << 8..((addr_h as usize + 1) << 8)];
+                    let mut record = [0; 3];
+                    if let Err(e) = reader.read_exact(&mut record) {
+                        let verified = records.len();
+                        return (records, verified, Err(Gbl32Error::Io(e)));
+                    }
+                    records.push((Instant::now(), record));
+                    if record != page_checksum(addr_h, page) {
+                        let verified = records.len() - 1;
+                        return (
+                            records,
+                            verified,
+                            Err(Gbl32Error::Protocol(format!(
+                                "Verification failed at {:02x}00",
+                                addr_h
+                            ))),
+                        );
+                    }
+                }
+                let verified = records.len();
+                (records, verified, Ok(()))
+            });
+            let written = self
+                .port
+                .write_all(data)
+                .and_then(|_| self.port.flush())
+                .map_err(Gbl32Error::Io);
+            let checked = checker.join().unwrap_or_else(|_| {
+                (
+                    Vec::new(),
+                    0,
+                    Err(Gbl32Error::Protocol(
+                        "Verification thread panicked".to_string(),
+                    )),
+                )
+            });
+            (written, checked)
+        });
+        let (records, checked_pages, checked) = checked;
+        *verified = checked_pages;
+        for (at, record) in records {
+            self.record_at(at, Direction::FromDevice, EventKind::Stream, &record)?;
+        }
+        written.and(checked)
+    }
+    fn write_resumable(&mut self, data: &[u8], verify: bool) -> Result<(), Gbl32Error> {
+        if data.len() != 0x8000 {
+            return Err(Gbl32Error::Protocol(format!(
+                "Expected 32768 bytes for writing, got {}",
+                data.len()
+            )));
+        }
+        let mut offset = 0;
+        let mut retries = 0;
+        loop {
+            // The checkpoint belongs to this attempt only if the firmware
+            // accepted the stream. Otherwise it was left by an earlier stream
+            let mut started = false;
+            let mut verified = 0;
+            let cmd = if verify { 0x0c } else { 0x09 };
+            let result = self
+                .start_stream(cmd, offset, 0x8000 - offset as usize)
+                .and_then(|_| {
+                    started = true;
+                    if verify {
+                        self.send_verified_stream(offset, data, &mut verified)
+                    } else {
+                        self.send_stream(&data[offset as usize..])
+                    }
+                });
+            match result {
+                Err(ref e) if e.is_transient() && retries < self.retry_policy.max_retries => {
+                    retries += 1;
+                    self.resync()?;
+                    if started {
+                        let mut checkpoint = self.stream_checkpoint()?;
+                        if verify {
+                            // Pages whose checksums weren't checked yet are
+                            // written again, so that every page is verified
+                            let verified_end = (offset as usize + (verified << 8)) as u16;
+                            checkpoint = (checkpoint & !0xff).min(verified_end);
+                        }
+                        if checkpoint >= offset {
+                            offset = checkpoint;
+                        }
+                    }
+                    if offset >= 0x8000 {
+                        return Ok(());
+                    }
+                    warn!("Resuming write stream from {:04x}", offset);
+                }
+                result => return result,
+            }
+        }
+    }
+    pub fn write_all(&mut self, data: &[u8]) -> Result<(), Gbl32Error> {
+        self.write_resumable(data, false)
+    }
+    /// Like `write_all`, but the firmware reads back every page and the
+    /// checksums are verified while the upload is still in progress
+    pub fn write_all_verified(&mut self, data: &[u8]) -> Result<(), Gbl32Error> {
+        self.write_resumable(data, true)
+    }
+    /// Returns a reader that streams SRAM contents as they arrive
+    pub fn sram_reader(&mut self) -> SramReader<'_> {
+        SramReader::new(self)
+    }
+    /// Returns a writer that streams data into SRAM in chunks
+    pub fn sram_writer(&mut self) -> SramWriter<'_> {
+        SramWriter::new(self)
+    }
     pub fn read_all(&mut self) -> Result<Vec<u8>, Gbl32Error> {
-        self.request_response(0x0a, &[], 0)?;
         let mut buf = vec![0; 0x8000];
-        self.port.read_exact(&mut buf).map_err(Gbl32Error::Io)?;
-        Ok(buf)
+        let mut offset = 0;
+        let mut retries = 0;
+        loop {
+            let mut received = 0;
+            match self.read_from(offset, &mut buf[offset as usize..], &mut received) {
+                Err(ref e) if e.is_transient() && retries < self.retry_policy.max_retries => {
+                    retries += 1;
+                    offset += received as u16;
+                    self.resync()?;
+                    if offset >= 0x8000 {
+                        return Ok(buf);
+                    }
+                    warn!("Resuming read stream from {:04x}", offset);
+                }
+                result => return result.map(|_| buf),
+            }
+        }
     }
 }
@@ -1,18 +1,28 @@
 use anyhow::{bail, format_err, Error};
+use bench::BenchConfig;
+use bufstream::BufStream;
 use clap::Parser as _;
-use gb_live32::Gbl32;
-use log::{error, info};
+use gb_live32::{
+    schedule::{Finished, Hub, HubLink, HubScheduler, ThrottledTransport},
+    timeline::Timeline,
+    trace::{self, SimulatedTransport, TraceEvent, TraceRecorder},
+    usb::UsbTransport,
+    Gbl32, Gbl32Error, RetryPolicy, Stamp, Transport,
+};
+use log::{error, info, warn};
 use rand::{rngs::SmallRng, RngCore, SeedableRng};
 use serialport::SerialPortType;
 use simplelog::{LevelFilter, TermLogger};
 use std::{
     ffi::OsString,
     fs::File,
-    io::{self, Read},
-    path::PathBuf,
+    io::{self, BufReader, BufWriter, Read, Write},
+    path::{Path, PathBuf},
     process, thread,
 };
 
+mod bench;
+
 fn scan_ports() -> Result<Vec<OsString>, Error> {
     let ports = serialport::available_ports()?
     .into_iter()
@@ -47,21 +57,172 @@ fn scan_ports() -> Result<Vec<OsString>, Error> {
 enum Operation {
     Upload(Vec<u8>),
     Status,
+    Dump(PathBuf),
+    Replay(Vec<TraceEvent>),
+    Bench(BenchConfig),
+}
+
+#[derive(Clone, Debug)]
+struct Options {
+    retries: u32,
+    trace: Option<PathBuf>,
+    retain: Option<bool>,
+    cdc: bool,
+    timeline: Option<PathBuf>,
+}
+
+/// Connects through the vendor bulk interface if the device has one, and
+/// through the CDC serial port otherwise
+fn connect(
+    name: &str,
+    port: &OsString,
+    cdc: bool,
+    trace: Option<TraceRecorder>,
+) -> Result<Gbl32, Error> {
+    if !cdc {
+        match UsbTransport::open_for_port(port) {
+            Ok(Some(transport)) => {
+                info!("{}: Using the vendor bulk interface", name);
+                return Ok(Gbl32::from_transport_traced(Box::new(transport), trace)?);
+            }
+            Ok(None) => (),
+            Err(e) => warn!(
+                "{}: Vendor bulk interface unavailable, falling back to CDC: {}",
+                name, e
+            ),
+        }
+    }
+    let transport: Box<dyn Transport> = Box::new(serialport::open(port)?);
+    Ok(Gbl32::from_transport_traced(transport, trace)?)
 }
 
-fn worker(port: &OsString, operation: Operation) -> Result<(), Error> {
+fn worker(port: &OsString, operation: Operation, options: Options) -> Result<(), Error> {
     let name = port.to_string_lossy();
-    let port = serialport::open(&port)?;
+    let mut timeline = options.timeline.as_ref().map(|_| {
+        let mut timeline = Timeline::new();
+        timeline.mark("Connecting");
+        timeline
+    });
+    // The trace starts before connecting, so it includes the handshake
+    let trace = match (&operation, &options.trace) {
+        (Operation::Replay(_), _) | (_, None) => None,
+        (_, Some(path)) => {
+            let file = BufWriter::new(File::create(path)?);
+            info!("{}: Recording trace to {}", name, path.display());
+            Some(TraceRecorder::new(Box::new(file))?)
+        }
+    };
     info!("{}: Connecting...", name);
-    let mut gbl32 = Gbl32::from_port(port)?;
+    let mut gbl32 = connect(&name, port, options.cdc, trace)?;
+
+    if let Operation::Replay(events) = operation {
+        info!("{}: Replaying {} events...", name, events.len());
+        let report = gbl32.replay(&events)?;
+        log_replay_report(&name, &report);
+        return Ok(());
+    }
+
+    let result = operate(&name, &mut gbl32, operation, &options, &mut timeline);
+    if let (Some(mut timeline), Some(path)) = (timeline, options.timeline) {
+        if let Err(ref err) = result {
+            timeline.mark(format!("Failed: {:#}", err));
+            // Get the events that explain the failure, if the device responds
+            let _ = gbl32.resync();
+        }
+        match timeline.drain(&mut gbl32) {
+            Ok(()) => (),
+            Err(e) => warn!("{}: Failed to drain device events: {}", name, e),
+        }
+        let mut file = BufWriter::new(File::create(&path)?);
+        write!(file, "{}", timeline)?;
+        file.flush()?;
+        info!("{}: Wrote timeline to {}", name, path.display());
+    }
+    result
+}
 
+/// Marks a host milestone on the timeline, and drains device events up to it
+fn checkpoint(
+    gbl32: &mut Gbl32,
+    timeline: &mut Option<Timeline>,
+    description: &str,
+) -> Result<(), Gbl32Error> {
+    match timeline {
+        Some(timeline) => {
+            timeline.mark(description);
+            timeline.drain(gbl32)
+        }
+        None => Ok(()),
+    }
+}
+
+fn operate(
+    name: &str,
+    gbl32: &mut Gbl32,
+    operation: Operation,
+    options: &Options,
+    timeline: &mut Option<Timeline>,
+) -> Result<(), Error> {
     let version = gbl32.get_version()?;
     match version {
-        (2, 0) | (2, 1) => (),
+        (2, 0) | (2, 1) | (2, 2) => (),
         (major, minor) => bail!("{}: Unsupported version v{}.{}", name, major, minor),
     }
-    info!("{}: Connected (v{}.{})", name, version.0, version.1);
-    unlock_if_necessary(&name, &mut gbl32)?;
+    info!(
+        "{}: Connected (v{}.{}) in {:?}",
+        name,
+        version.0,
+        version.1,
+        gbl32.connect_latency()
+    );
+    if timeline.is_some() && version < (2, 2) {
+        bail!("{}: Timelines require firmware v2.2", name);
+    }
+    checkpoint(gbl32, timeline, "Connected")?;
+    if let Operation::Dump(path) = operation {
+        if version < (2, 2) {
+            bail!("{}: Dumping requires firmware v2.2", name);
+        }
+        return dump(name, gbl32, &path);
+    }
+    if version >= (2, 2) {
+        gbl32.set_retry_policy(RetryPolicy {
+            max_retries: options.retries,
+        });
+    }
+    if let Some(retain) = options.retain {
+        if version < (2, 2) {
+            bail!("{}: SRAM retention requires firmware v2.2", name);
+        }
+        gbl32.set_retain(retain)?;
+        info!(
+            "{}: SRAM retention {}",
+            name,
+            if retain { "enabled" } else { "disabled" }
+        );
+    }
+
+    // Stamping costs EEPROM writes and a pass over SRAM, which only pays off
+    // if SRAM is retained
+    let (stamp, retained) = match operation {
+        Operation::Upload(ref data) if version >= (2, 2) => {
+            let retention = gbl32.get_retention()?;
+            if retention.enabled {
+                let stamp = Stamp::for_image(data);
+                (Some(stamp), retention.stamp == Some(stamp))
+            } else {
+                (None, false)
+            }
+        }
+        _ => (None, false),
+    };
+    if retained {
+        // The stamp proves the data path worked when the image was uploaded
+        gbl32.set_unlocked(true)?;
+    } else {
+        unlock_if_necessary(name, gbl32, version)?;
+    }
+    checkpoint(gbl32, timeline, "Unlocked")?;
 
     match operation {
         Operation::Upload(data) => {
@@ -69,8 +230,17 @@ fn worker(port: &OsString, operation: Operation) -> Result<(), Error> {
             gbl32.set_reset(true)?;
             gbl32.set_passthrough(false)?;
 
-            gbl32.write_all(&data)?;
+            if retained {
+                info!("{}: SRAM already contains the ROM, skipping upload", name);
+            } else {
+                gbl32.write_all(&data)?;
+                if let Some(stamp) = stamp {
+                    // The firmware rejects the stamp unless SRAM matches it
+                    gbl32.set_stamp(stamp)?;
+                }
+            }
 
+            checkpoint(gbl32, timeline, "Uploaded")?;
             gbl32.set_passthrough(true)?;
             gbl32.set_reset(false)?;
             info!("{}: Wrote ROM and reset the system", name);
@@ -82,11 +252,124 @@ fn worker(port: &OsString, operation: Operation) -> Result<(), Error> {
                 status.unlocked, status.passthrough, status.reset
             );
         }
+        Operation::Bench(config) => {
+            // Resumed streams would hide stalls in the measurements
+            gbl32.set_retry_policy(RetryPolicy::default());
+            bench::run(name, gbl32, version, &config)?
+        }
+        Operation::Dump(_) | Operation::Replay(_) => unreachable!(),
+    }
+    Ok(())
+}
+
+fn log_replay_report(name: &str, report: &trace::ReplayReport) {
+    info!("{}: Replay finished: {}", name, report);
+    for latency in report.worst(5) {
+        info!(
+            "{}: Event #{} ({:?}): {:?} (recorded {:?})",
+            name, latency.index, latency.kind, latency.replayed, latency.recorded
+        );
+    }
+}
+
+/// Reports jobs whose worker thread panicked as failed, named by `name`
+fn job_results<T>(
+    results: Vec<Finished<thread::Result<Result<T, Error>>>>,
+    name: impl Fn(usize) -> String,
+) -> Vec<Finished<Result<T, Error>>> {
+    results
+        .into_iter()
+        .enumerate()
+        .map(|(index, finished)| {
+            finished.map(|result| {
+                result
+                    .unwrap_or_else(|_| Err(format_err!("{}: worker thread panicked", name(index))))
+            })
+        })
+        .collect()
+}
+
+/// Logs when the first device became ready and when the whole batch was done
+fn log_batch_timing<T>(results: &[Finished<Result<T, Error>>]) {
+    if results.len() < 2 {
+        return;
+    }
+    let first = results
+        .iter()
+        .filter(|finished| finished.result.is_ok())
+        .map(|finished| finished.elapsed)
+        .min();
+    let last = results.iter().map(|finished| finished.elapsed).max();
+    if let (Some(first), Some(last)) = (first, last) {
+        info!(
+            "First device ready after {:?}, all devices done after {:?}",
+            first, last
+        );
+    }
+}
+
+fn replay_simulated(
+    events: &[TraceEvent],
+    simulation: &Simulation,
+    scheduler: HubScheduler,
+) -> Result<(), Error> {
+    info!(
+        "Replaying {} events against {} simulated devices on {} hubs ({} KiB/s per hub, {} concurrent per hub)...",
+        events.len(),
+        simulation.devices,
+        simulation.hubs,
+        simulation.hub_bandwidth,
+        scheduler.per_hub
+    );
+    let links = (0..simulation.hubs)
+        .map(|_| HubLink::new(simulation.hub_bandwidth * 1024))
+        .collect::<Vec<_>>();
+    let jobs = (0..simulation.devices)
+        .map(|device| {
+            let hub = device % simulation.hubs;
+            (
+                Hub::Path(format!("sim{}", hub)),
+                (device, links[hub].clone()),
+            )
+        })
+        .collect::<Vec<_>>();
+    let results = scheduler.run(jobs, |(device, link)| -> Result<(), Error> {
+        let transport = ThrottledTransport::new(SimulatedTransport::new(events), link);
+        let mut port = BufStream::new(Box::new(transport));
+        let report = trace::replay(&mut port, events)?;
+        log_replay_report(&format!("simulated{}", device), &report);
+        Ok(())
+    });
+    let results = job_results(results, |device| format!("simulated{}", device));
+    for finished in &results {
+        if let Err(ref err) = finished.result {
+            error!("{:#}", err);
+        }
     }
+    log_batch_timing(&results);
+    Ok(())
+}
+
+fn dump(name: &str, gbl32: &mut Gbl32, path: &Path) -> Result<(), Error> {
+    if !gbl32.get_status()?.unlocked {
+        bail!("{}: Device is locked, so SRAM has no uploaded data", name);
+    }
+    gbl32.set_reset(true)?;
+    gbl32.set_passthrough(false)?;
+
+    let len = if path == Path::new("-") {
+        io::copy(&mut gbl32.sram_reader(), &mut io::stdout().lock())?
+    } else {
+        io::copy(&mut gbl32.sram_reader(), &mut File::create(path)?)?
+    };
+
+    gbl32.set_passthrough(true)?;
+    gbl32.set_reset(false)?;
+    info!("{}: Dumped {} bytes of SRAM", name, len);
     Ok(())
 }
 
-fn unlock_if_necessary(name: &str, gbl32: &mut Gbl32) -> Result<(), Error> {
+fn unlock_if_necessary(name: &str, gbl32: &mut Gbl32, version: (u8, u8)) -> Result<(), Error> {
     if gbl32.get_status()?.unlocked {
         return Ok(());
     }
@@ -99,13 +382,18 @@ fn unlock_if_necessary(name: &str, gbl32: &mut Gbl32) -> Result<(), Error> {
     let mut rng = SmallRng::from_entropy();
     rng.fill_bytes(&mut buffer);
 
-    gbl32.write_all(&buffer)?;
+    if version >= (2, 2) {
+        // Pages are read back and checked while the upload is in progress
+        gbl32.write_all_verified(&buffer)?;
+    } else {
+        gbl32.write_all(&buffer)?;
 
-    let data = gbl32.read_all()?;
+        let data = gbl32.read_all()?;
 
-    for (idx, (a, b)) in buffer.into_iter().zip(data.into_iter()).enumerate() {
-        if a != b {
-            bail!("Self-test failed at index {}", idx);
+        for (idx, (a, b)) in buffer.into_iter().zip(data.into_iter()).enumerate() {
+            if a != b {
+                bail!("Self-test failed at index {}", idx);
+            }
         }
     }
 
@@ -117,13 +405,41 @@ fn unlock_if_necessary(name: &str, gbl32: &mut Gbl32) -> Result<(), Error> {
 }
 
 fn run(args: Args) -> Result<(), Error> {
+    // Keep stdout clean when it's used for data
+    let terminal_mode = if args.dump.as_deref() == Some(Path::new("-")) {
+        simplelog::TerminalMode::Stderr
+    } else {
+        simplelog::TerminalMode::Mixed
+    };
     let _ = TermLogger::init(
         LevelFilter::Debug,
         simplelog::Config::default(),
-        simplelog::TerminalMode::Mixed,
+        terminal_mode,
         simplelog::ColorChoice::Auto,
     );
 
+    let replay = match args.replay {
+        Some(ref path) => Some(trace::read_trace(BufReader::new(File::open(path)?))?),
+        None => None,
+    };
+    let scheduler = HubScheduler {
+        per_hub: args.per_hub,
+    };
+    if args.simulate {
+        let simulation = Simulation {
+            devices: args.devices,
+            hubs: args.hubs,
+            hub_bandwidth: args.hub_bandwidth,
+        };
+        if simulation.devices == 0 || simulation.hubs == 0 {
+            bail!("Simulation requires at least one device and hub");
+        }
+        match replay {
+            Some(ref events) => return replay_simulated(events, &simulation, scheduler),
+            None => bail!("Simulation requires a trace to replay"),
+        }
+    }
+
     let ports;
     if args.broadcast {
         ports = scan_ports()?;
@@ -139,6 +455,12 @@ fn run(args: Args) -> Result<(), Error> {
     if ports.is_empty() {
         bail!("No supported devices found");
     }
+    if args.trace.is_some() && ports.len() > 1 {
+        bail!("Trace recording requires a single device");
+    }
+    if args.timeline.is_some() && ports.len() > 1 {
+        bail!("Timeline recording requires a single device");
+    }
 
     info!(
         "Using {}: {}",
@@ -150,7 +472,16 @@ fn run(args: Args) -> Result<(), Error> {
         itertools::join(ports.iter().map(|p| p.to_string_lossy()), ", ")
     );
 
-    let operation = if let Some(path) = args.upload {
+    let operation = if let Some(Command::Bench { iterations, passes }) = args.command {
+        Operation::Bench(BenchConfig { iterations, passes })
+    } else if let Some(events) = replay {
+        Operation::Replay(events)
+    } else if let Some(path) = args.dump {
+        if ports.len() > 1 {
+            bail!("Dumping requires a single device");
+        }
+        Operation::Dump(path)
+    } else if let Some(path) = args.upload {
         let mut file = File::open(path)?;
         let mut buf = vec![0; 0x8000];
         match file.read_exact(&mut buf) {
@@ -170,25 +501,40 @@ fn run(args: Args) -> Result<(), Error> {
         Operation::Status
     };
 
-    let threads = ports
+    let options = Options {
+        retries: args.retries,
+        trace: args.trace.clone(),
+        retain: args.retain,
+        cdc: args.cdc,
+        timeline: args.timeline.clone(),
+    };
+    let jobs = ports
         .into_iter()
         .map(|port| {
-            let name = port.to_string_lossy().to_string();
-            let op = operation.clone();
-            (name, thread::spawn(move || worker(&port, op)))
+            let hub = Hub::of_port(&port);
+            if let Hub::Path(ref path) = hub {
+                info!("{}: Connected through hub {}", port.to_string_lossy(), path);
+            }
+            (hub, port)
         })
         .collect::<Vec<_>>();
+    let names = jobs
+        .iter()
+        .map(|(_, port)| port.to_string_lossy().into_owned())
+        .collect::<Vec<_>>();
+    let results = scheduler.run(jobs, |port| {
+        worker(&port, operation.clone(), options.clone())
+    });
+    let results = job_results(results, |index| names[index].clone());
 
     let mut failures = 0;
-    for (name, thread) in threads {
-        let result = thread
-            .join()
-            .map_err(|_| format_err!("{}: failed to wait for worker thread", name))?;
-        if let Err(ref err) = result {
+    for finished in &results {
+        if let Err(ref err) = finished.result {
             error!("{:#}", err);
             failures += 1;
         }
     }
+    log_batch_timing(&results);
 
     if failures > 0 {
         bail!("{} devices failed", failures);
@@ -196,9 +542,40 @@ fn run(args: Args) -> Result<(), Error> {
     Ok(())
 }
 
+#[derive(Clone, Debug)]
+struct Simulation {
+    devices: usize,
+    hubs: usize,
+    /// Hub upstream bandwidth in KiB/s
+    hub_bandwidth: u32,
+}
+
+#[derive(clap::Subcommand, Debug)]
+enum Command {
+    #[command(about = "Measure command latencies and stream throughput (overwrites SRAM)")]
+    Bench {
+        #[arg(
+            long,
+            default_value_t = 100,
+            help = "Number of pings and status queries"
+        )]
+        iterations: usize,
+
+        #[arg(
+            long,
+            default_value_t = 3,
+            help = "Number of passes over SRAM with blocks and streams"
+        )]
+        passes: usize,
+    },
+}
+
 #[derive(clap::Parser, Debug)]
 #[command(author, version, about)]
 struct Args {
+    #[command(subcommand)]
+    command: Option<Command>,
+
     #[arg(short, long, help = "Broadcast mode: use all connected devices")]
     broadcast: bool,
 
@@ -207,6 +584,77 @@ struct Args {
 
     #[arg(short, long, help = "ROM file to upload")]
     upload: Option<PathBuf>,
+
+    #[arg(
+        long,
+        default_value_t = 3,
+        help = "Number of times to resume an interrupted stream"
+    )]
+    retries: u32,
+
+    #[arg(
+        short,
+        long,
+        conflicts_with = "upload",
+        help = "Dump SRAM into a file (- for stdout)"
+    )]
+    dump: Option<PathBuf>,
+
+    #[arg(
+        long,
+        help = "Keep SRAM contents across firmware resets if they match the last upload"
+    )]
+    retain: Option<bool>,
+
+    #[arg(long, help = "Always use the CDC serial interface")]
+    cdc: bool,
+
+    #[arg(long, help = "Record a protocol trace into a file")]
+    trace: Option<PathBuf>,
+
+    #[arg(
+        long,
+        help = "Write a timeline of host milestones and device events into a file"
+    )]
+    timeline: Option<PathBuf>,
+
+    #[arg(long, help = "Replay a protocol trace and compare timing")]
+    replay: Option<PathBuf>,
+
+    #[arg(long, requires = "replay", help = "Replay against a simulated device")]
+    simulate: bool,
+
+    #[arg(
+        long,
+        default_value_t = 2,
+        help = "Maximum number of devices per USB hub to work on at once (0 = unlimited)"
+    )]
+    per_hub: usize,
+
+    #[arg(
+        long,
+        default_value_t = 1,
+        requires = "simulate",
+        help = "Number of simulated devices"
+    )]
+    devices: usize,
+
+    #[arg(
+        long,
+        default_value_t = 1,
+        requires = "simulate",
+        help = "Number of simulated hubs"
+    )]
+    hubs: usize,
+
+    #[arg(
+        long,
+        default_value_t = 1000,
+        requires = "simulate",
+        value_parser = clap::value_parser!(u32).range(1..),
+        help = "Upstream bandwidth of each simulated hub in KiB/s"
+    )]
+    hub_bandwidth: u32,
 }
 
 fn main() {
@@ -0,0 +1,313 @@
+//! Scheduling of broadcast work across USB hubs.
+//!
+//! Devices behind the same hub share its upstream bandwidth, so running every
+//! device at once makes them all finish late. Jobs are grouped by hub, and
+//! each hub runs at most `per_hub` jobs at a time, while different hubs run in
+//! parallel. With a full-speed hub, this gets the first devices ready much
+//! earlier without making the whole batch slower.
+use std::{
+    collections::{BTreeMap, VecDeque},
+    ffi::OsStr,
+    io::{self, Read, Write},
+    panic::{self, AssertUnwindSafe},
+    path::Path,
+    sync::{Arc, Mutex},
+    thread,
+    time::{Duration, Instant},
+};
+
+use crate::Transport;
+
+/// Identifies the hub a device is connected to
+#[derive(Debug, Clone, Eq, PartialEq, Ord, PartialOrd)]
+pub enum Hub {
+    /// sysfs name of the hub device, e.g. `1-2` or `3-1.4`
+    Path(String),
+    /// Topology is unknown, so the device is scheduled as if it had a hub of
+    /// its own
+    Unknown(String),
+}
+
+impl Hub {
+    /// Finds the hub of a serial port from sysfs.
+    ///
+    /// `/sys/class/tty/<port>/device` links to the USB interface, whose parent
+    /// is the USB device, whose parent is the hub. Devices connected directly
+    /// to a root port get the root hub (`usbN`).
+    pub fn of_port(port: &OsStr) -> Hub {
+        let path = Path::new(port);
+        let unknown = || Hub::Unknown(path.to_string_lossy().into_owned());
+        let tty = match path.file_name() {
+            Some(tty) => tty,
+            None => return unknown(),
+        };
+        let interface = match Path::new("/sys/class/tty")
+            .join(tty)
+            .join("device")
+            .canonicalize()
+        {
+            Ok(interface) => interface,
+            Err(_) => return unknown(),
+        };
+        match interface
+            .parent()
+            .and_then(Path::parent)
+            .and_then(Path::file_name)
+        {
+            Some(hub) => Hub::Path(hub.to_string_lossy().into_owned()),
+            None => unknown(),
+        }
+    }
+}
+
+/// Completion time of a job, measured from the start of the batch
+#[derive(Debug)]
+pub struct Finished<R> {
+    pub elapsed: Duration,
+    pub result: R,
+}
+
+impl<R> Finished<R> {
+    pub fn map<S>(self, f: impl FnOnce(R) -> S) -> Finished<S> {
+        Finished {
+            elapsed: self.elapsed,
+            result: f(self.result),
+        }
+    }
+}
+
+/// Runs jobs with a per-hub concurrency limit
+#[derive(Debug, Copy, Clone, Eq, PartialEq)]
+pub struct HubScheduler {
+    /// Maximum number of concurrent jobs per hub (0 = unlimited)
+    pub per_hub: usize,
+}
+
+impl HubScheduler {
+    /// Runs `work` for every job, and returns the results in job order.
+    ///
+    /// Every hub starts its first jobs immediately, so the time to the first
+    /// finished job is bounded by the least loaded hub. Within a hub, jobs run
+    /// in the given order. A job that panics gets the panic as its result,
+    /// and the other jobs are not affected.
+    pub fn run<T, R, F>(&self, jobs: Vec<(Hub, T)>, work: F) -> Vec<Finished<thread::Result<R>>>
+    where
+        T: Send,
+        R: Send,
+        F: Fn(T) -> R + Sync,
+    {
+        let count = jobs.len();
+        let mut queues: BTreeMap<Hub, VecDeque<(usize, T)>> = BTreeMap::new();
+        for (index, (hub, job)) in jobs.into_iter().enumerate() {
+            queues.entry(hub).or_default().push_back((index, job));
+        }
+        let results: Mutex<Vec<Option<Finished<thread::Result<R>>>>> =
+            Mutex::new((0..count).map(|_| None).collect());
+        let start = Instant::now();
+        thread::scope(|scope| {
+            for queue in queues.into_values() {
+                let workers = match self.per_hub {
+                    0 => queue.len(),
+                    limit => limit.min(queue.len()),
+                };
+                let queue = Arc::new(Mutex::new(queue));
+                for _ in 0..workers {
+                    let queue = Arc::clone(&queue);
+                    let (results, work) = (&results, &work);
+                    scope.spawn(move || loop {
+                        let next = queue.lock().unwrap().pop_front();
+                        let (index, job) = match next {
+                            Some(next) => next,
+                            None => break,
+                        };
+                        let result = panic::catch_unwind(AssertUnwindSafe(|| work(job)));
+                        results.lock().unwrap()[index] = Some(Finished {
+                            elapsed: start.elapsed(),
+                            result,
+                        });
+                    });
+                }
+            }
+        });
+        results
+            .into_inner()
+            .unwrap()
+            .into_iter()
+            .map(|finished| finished.expect("Job was not run"))
+            .collect()
+    }
+}
+
+/// Shared upstream link of a simulated hub.
+///
+/// Transfers are served one at a time in arrival order, so devices on the
+/// same link slow each other down like they do on a real full-speed hub.
+#[derive(Debug)]
+pub struct HubLink {
+    bytes_per_second: u32,
+    busy_until: Mutex<Instant>,
+}
+
+impl HubLink {
+    pub fn new(bytes_per_second: u32) -> Arc<HubLink> {
+        assert!(bytes_per_second > 0);
+        Arc::new(HubLink {
+            bytes_per_second,
+            busy_until: Mutex::new(Instant::now()),
+        })
+    }
+    /// Blocks until `len` bytes have been transferred over the link
+    fn transfer(&self, len: usize) {
+        let duration = Duration::from_secs_f64(len as f64 / self.bytes_per_second as f64);
+        let done = {
+            let mut busy_until = self.busy_until.lock().unwrap();
+            *busy_until = (*busy_until).max(Instant::now()) + duration;
+            *busy_until
+        };
+        let now = Instant::now();
+        if done > now {
+            thread::sleep(done - now);
+        }
+    }
+}
+
+/// Transport that carries all data over a bandwidth-limited `HubLink`
+pub struct ThrottledTransport<T> {
+    inner: T,
+    link: Arc<HubLink>,
+}
+
+impl<T: Transport> ThrottledTransport<T> {
+    pub fn new(inner: T, link: Arc<HubLink>) -> ThrottledTransport<T> {
+        ThrottledTransport { inner, link }
+    }
+}
+
+impl<T: Transport> Read for ThrottledTransport<T> {
+    fn read(&mut self, buf: &mut [u8]) -> io::Result<usize> {
+        let len = self.inner.read(buf)?;
+        self.link.transfer(len);
+        Ok(len)
+    }
+}
+
+impl<T: Transport> Write for ThrottledTransport<T> {
+    fn write(&mut self, buf: &[u8]) -> io::Result<usize> {
+        let len = self.inner.write(buf)?;
+        self.link.transfer(len);
+        Ok(len)
+    }
+    fn flush(&mut self) -> io::Result<()> {
+        self.inner.flush()
+    }
+}
+
+impl<T: Transport> Transport for ThrottledTransport<T> {
+    fn set_timeout(&mut self, timeout: Duration) -> io::Result<()> {
+        self.inner.set_timeout(timeout)
+    }
+    fn clear(&mut self) -> io::Result<()> {
+        self.inner.clear()
+    }
+    fn try_clone(&self) -> io::Result<Box<dyn Transport>> {
+        Err(io::Error::new(
+            io::ErrorKind::Unsupported,
+            "Throttled transport can't be cloned",
+        ))
+    }
+    fn abort(&mut self) -> io::Result<()> {
+        self.inner.abort()
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::trace::SimulatedTransport;
+    use std::sync::atomic::{AtomicUsize, Ordering};
+
+    const PACKET_SIZE: usize = 64;
+    const JOB_SIZE: usize = 50 * PACKET_SIZE;
+    /// Each job takes 50 ms if it has the link to itself
+    const BYTES_PER_SECOND: u32 = 64_000;
+
+    /// Concurrency of the jobs on one hub
+    #[derive(Default)]
+    struct Activity {
+        active: AtomicUsize,
+        max: AtomicUsize,
+    }
+
+    /// Writes a job's data over `link` in USB-sized packets
+    fn transfer(link: &Arc<HubLink>, activity: &Activity) -> io::Result<()> {
+        let active = activity.active.fetch_add(1, Ordering::SeqCst) + 1;
+        activity.max.fetch_max(active, Ordering::SeqCst);
+        let mut transport = ThrottledTransport::new(SimulatedTransport::new(&[]), link.clone());
+        let result =
+            (0..JOB_SIZE / PACKET_SIZE).try_for_each(|_| transport.write_all(&[0x5a; PACKET_SIZE]));
+        activity.active.fetch_sub(1, Ordering::SeqCst);
+        result
+    }
+
+    fn first_finished(per_hub: usize) -> Duration {
+        let link = HubLink::new(BYTES_PER_SECOND);
+        let activity = Activity::default();
+        let jobs = (0..4).map(|_| (Hub::Path("1-1".to_string()), ())).collect();
+        let results = HubScheduler { per_hub }.run(jobs, |_| transfer(&link, &activity));
+        results
+            .iter()
+            .map(|finished| {
+                assert!(matches!(finished.result, Ok(Ok(()))));
+                finished.elapsed
+            })
+            .min()
+            .unwrap()
+    }
+
+    #[test]
+    fn limits_concurrency_per_hub() {
+        let hubs = ["1-1", "1-2"];
+        let links = hubs.map(|_| HubLink::new(BYTES_PER_SECOND));
+        let activity = hubs.map(|_| Activity::default());
+        let jobs = (0..10)
+            .map(|index| (Hub::Path(hubs[index % 2].to_string()), index % 2))
+            .collect();
+        let results =
+            HubScheduler { per_hub: 2 }.run(jobs, |hub| transfer(&links[hub], &activity[hub]));
+        assert_eq!(results.len(), 10);
+        assert!(results
+            .iter()
+            .all(|finished| matches!(finished.result, Ok(Ok(())))));
+        for activity in &activity {
+            assert_eq!(activity.max.load(Ordering::SeqCst), 2);
+        }
+    }
+
+    #[test]
+    fn limit_gets_first_job_done_earlier() {
+        let limited = first_finished(1);
+        let unlimited = first_finished(0);
+        assert!(
+            limited < unlimited,
+            "first job finished after {:?} with one job at a time, {:?} unlimited",
+            limited,
+            unlimited
+        );
+    }
+
+    #[test]
+    fn panicking_job_is_reported() {
+        let jobs = (0..3)
+            .map(|index| (Hub::Unknown(format!("job{}", index)), index))
+            .collect();
+        let results = HubScheduler { per_hub: 1 }.run(jobs, |index| {
+            if index == 1 {
+                panic!("Job {} failed", index);
+            }
+            index
+        });
+        assert!(matches!(results[0].result, Ok(0)));
+        assert!(results[1].result.is_err());
+        assert!(matches!(results[2].result, Ok(2)));
+    }
+}
@@ -0,0 +1,186 @@
+//! `std::io` adapters over the 32 KB cartridge SRAM.
+//!
+//! Both adapters use stream commands, so data is transferred at stream
+//! speed, but is produced and consumed incrementally instead of as whole
+//! 32 KB buffers. Requires firmware v2.2 or later.
+use std::{
+    cmp,
+    io::{self, Read, Seek, SeekFrom, Write},
+};
+
+use crate::{Gbl32, Gbl32Error};
+
+const SRAM_SIZE: u64 = 0x8000;
+
+/// Buffered data is written as one stream once this many bytes are pending
+const WRITE_CHUNK_SIZE: usize = 0x1000;
+
+/// Forward seeks up to this far read through the active stream. Longer ones
+/// abort it, because restarting the stream is cheaper
+const MAX_SKIP: u64 = 0x400;
+
+fn io_error(e: Gbl32Error) -> io::Error {
+    match e {
+        Gbl32Error::Io(e) => e,
+        e => io::Error::other(e),
+    }
+}
+
+fn seek_target(position: u64, pos: SeekFrom) -> io::Result<u64> {
+    let target = match pos {
+        SeekFrom::Start(offset) => Some(offset),
+        SeekFrom::End(offset) => SRAM_SIZE.checked_add_signed(offset),
+        SeekFrom::Current(offset) => position.checked_add_signed(offset),
+    };
+    match target {
+        Some(target) if target <= SRAM_SIZE => Ok(target),
+        _ => Err(io::Error::new(
+            io::ErrorKind::InvalidInput,
+            "Seek outside of SRAM",
+        )),
+    }
+}
+
+/// Reads SRAM sequentially with a TX stream.
+///
+/// A stream is started at the current position on the first read, and runs
+/// until the end of SRAM. Short forward seeks skip data within the stream.
+/// Other seeks, and dropping the reader mid-stream, abort the stream.
+pub struct SramReader<'a> {
+    gbl32: &'a mut Gbl32,
+    position: u64,
+    /// Bytes left in the active stream
+    streaming: u64,
+}
+
+impl<'a> SramReader<'a> {
+    pub(crate) fn new(gbl32: &'a mut Gbl32) -> SramReader<'a> {
+        SramReader {
+            gbl32,
+            position: 0,
+            streaming: 0,
+        }
+    }
+    fn skip(&mut self, mut len: u64) -> io::Result<()> {
+        let mut buf = [0; 256];
+        while len > 0 {
+            let chunk = cmp::min(len, buf.len() as u64) as usize;
+            let read = self.read(&mut buf[..chunk])?;
+            len -= read as u64;
+        }
+        Ok(())
+    }
+    /// Ends the active stream with an out-of-band abort
+    fn abort(&mut self) -> io::Result<()> {
+        if self.streaming > 0 {
+            self.streaming = 0;
+            self.gbl32.resync().map_err(io_error)?;
+        }
+        Ok(())
+    }
+}
+
+impl Read for SramReader<'_> {
+    fn read(&mut self, buf: &mut [u8]) -> io::Result<usize> {
+        if self.position >= SRAM_SIZE || buf.is_empty() {
+            return Ok(0);
+        }
+        if self.streaming == 0 {
+            let len = SRAM_SIZE - self.position;
+            self.gbl32
+                .start_stream(0x0a, self.position as u16, len as usize)
+                .map_err(io_error)?;
+            self.streaming = len;
+        }
+        let len = cmp::min(buf.len() as u64, self.streaming) as usize;
+        let read = self.gbl32.read_stream(&mut buf[..len]).map_err(io_error)?;
+        self.position += read as u64;
+        self.streaming -= read as u64;
+        Ok(read)
+    }
+}
+
+impl Seek for SramReader<'_> {
+    fn seek(&mut self, pos: SeekFrom) -> io::Result<u64> {
+        let target = seek_target(self.position, pos)?;
+        if target >= self.position && target - self.position <= self.streaming.min(MAX_SKIP) {
+            self.skip(target - self.position)?;
+        } else {
+            self.abort()?;
+        }
+        self.position = target;
+        Ok(target)
+    }
+}
+
+impl Drop for SramReader<'_> {
+    fn drop(&mut self) {
+        // Keep the session in sync for the next command
+        let _ = self.abort();
+    }
+}
+
+/// Writes SRAM with RX streams.
+///
+/// Data is buffered, and written as a stream of the buffered range when
+/// enough data is pending, or on `flush`, `seek` and drop.
+pub struct SramWriter<'a> {
+    gbl32: &'a mut Gbl32,
+    position: u64,
+    /// Pending data, starting at `position`
+    buffer: Vec<u8>,
+}
+
+impl<'a> SramWriter<'a> {
+    pub(crate) fn new(gbl32: &'a mut Gbl32) -> SramWriter<'a> {
+        SramWriter {
+            gbl32,
+            position: 0,
+            buffer: Vec::with_capacity(WRITE_CHUNK_SIZE),
+        }
+    }
+    fn write_buffer(&mut self) -> io::Result<()> {
+        if self.buffer.is_empty() {
+            return Ok(());
+        }
+        self.gbl32
+            .write_from(self.position as u16, &self.buffer)
+            .map_err(io_error)?;
+        self.position += self.buffer.len() as u64;
+        self.buffer.clear();
+        Ok(())
+    }
+}
+
+impl Write for SramWriter<'_> {
+    fn write(&mut self, buf: &[u8]) -> io::Result<usize> {
+        let space = SRAM_SIZE - self.position - self.buffer.len() as u64;
+        let len = cmp::min(
+            cmp::min(buf.len() as u64, space) as usize,
+            WRITE_CHUNK_SIZE - self.buffer.len(),
+        );
+        self.buffer.extend_from_slice(&buf[..len]);
+        if self.buffer.len() >= WRITE_CHUNK_SIZE {
+            self.write_buffer()?;
+        }
+        Ok(len)
+    }
+    fn flush(&mut self) -> io::Result<()> {
+        self.write_buffer()
+    }
+}
+
+impl Seek for SramWriter<'_> {
+    fn seek(&mut self, pos: SeekFrom) -> io::Result<u64> {
+        let target = seek_target(self.position + self.buffer.len() as u64, pos)?;
+        self.write_buffer()?;
+        self.position = target;
+        Ok(target)
+    }
+}
+
+impl Drop for SramWriter<'_> {
+    fn drop(&mut self) {
+        let _ = self.write_buffer();
+    }
+}
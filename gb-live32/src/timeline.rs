@@ -0,0 +1,258 @@
+//! Device event logs and host/device timelines.
+//!
+//! Firmware v2.2 records compact events (commands, stream start and end,
+//! stalls, recoveries, USB bus events) into a small ring buffer, stamped
+//! with the USB frame number extended to 16 bits. Frames are 1 ms apart, so
+//! stamps wrap every 65.5 s.
+//!
+//! A `Timeline` maps drained device events onto host time. The device's
+//! current frame is reported by each drain and is assumed to correspond to
+//! the midpoint of the drain's round trip, so the alignment error is about
+//! half the round trip plus one frame.
+use std::{
+    fmt,
+    time::{Duration, Instant},
+};
+
+use crate::{Gbl32, Gbl32Error};
+
+/// Number of records in a drain response, matching the firmware ring size
+pub(crate) const EVENT_LOG_SIZE: usize = 32;
+
+const FRAME_DURATION: Duration = Duration::from_millis(1);
+
+#[derive(Debug, Copy, Clone, Eq, PartialEq)]
+pub enum DeviceEvent {
+    /// Firmware started. `rcon` is the reset control register at boot
+    Boot {
+        rcon: u8,
+    },
+    Command(u8),
+    StreamStart(u8),
+    StreamEnd(u8),
+    StreamAbort(u8),
+    /// The main loop has been waiting for the host for `ticks` frames
+    Blocked {
+        ticks: u16,
+    },
+    /// The session was reset after a stall
+    Recovery(u8),
+    UsbReset,
+    UsbSuspend,
+    UsbResume,
+    Unknown {
+        code: u8,
+        arg: u8,
+    },
+}
+
+impl DeviceEvent {
+    fn decode(code: u8, arg: u8) -> DeviceEvent {
+        match code {
+            0x01 => DeviceEvent::Boot { rcon: arg },
+            0x02 => DeviceEvent::Command(arg),
+            0x03 => DeviceEvent::StreamStart(arg),
+            0x04 => DeviceEvent::StreamEnd(arg),
+            0x05 => DeviceEvent::StreamAbort(arg),
+            0x06 => DeviceEvent::Blocked {
+                ticks: arg as u16 * 10,
+            },
+            0x07 => DeviceEvent::Recovery(arg),
+            0x08 => DeviceEvent::UsbReset,
+            0x09 => DeviceEvent::UsbSuspend,
+            0x0a => DeviceEvent::UsbResume,
+            code => DeviceEvent::Unknown { code, arg },
+        }
+    }
+}
+
+fn state_name(tag: u8) -> &'static str {
+    match tag {
+        0 => "command",
+        1 => "rx stream",
+        2 => "tx stream",
+        _ => "unknown",
+    }
+}
+
+impl fmt::Display for DeviceEvent {
+    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+        match *self {
+            DeviceEvent::Boot { rcon } => {
+                // RCON.TO is cleared by a watchdog timeout
+                let cause = if rcon & 0x08 == 0 { ", watchdog" } else { "" };
+                write!(f, "Boot (RCON {:02x}{})", rcon, cause)
+            }
+            DeviceEvent::Command(cmd) => write!(f, "Command 0x{:02x}", cmd),
+            DeviceEvent::StreamStart(tag) => write!(f, "Start {}", state_name(tag)),
+            DeviceEvent::StreamEnd(tag) => write!(f, "End {}", state_name(tag)),
+            DeviceEvent::StreamAbort(tag) => write!(f, "Abort {}", state_name(tag)),
+            DeviceEvent::Blocked { ticks } => write!(f, "Blocked for {} frames", ticks),
+            DeviceEvent::Recovery(tag) => write!(f, "Recovered from stall in {}", state_name(tag)),
+            DeviceEvent::UsbReset => write!(f, "USB reset"),
+            DeviceEvent::UsbSuspend => write!(f, "USB suspend"),
+            DeviceEvent::UsbResume => write!(f, "USB resume"),
+            DeviceEvent::Unknown { code, arg } => {
+                write!(f, "Unknown event {:02x} ({:02x})", code, arg)
+            }
+        }
+    }
+}
+
+#[derive(Debug, Copy, Clone, Eq, PartialEq)]
+pub struct LoggedEvent {
+    pub frame: u16,
+    pub event: DeviceEvent,
+}
+
+/// Events drained from a device, oldest first
+#[derive(Debug, Clone, Eq, PartialEq)]
+pub struct EventLog {
+    /// Number of events lost because the ring buffer was full
+    pub dropped: u8,
+    /// Frame stamp at the time of the drain
+    pub frame: u16,
+    pub events: Vec<LoggedEvent>,
+}
+
+impl EventLog {
+    pub(crate) fn parse(data: &[u8]) -> EventLog {
+        let count = (data[1] as usize).min(EVENT_LOG_SIZE);
+        EventLog {
+            dropped: data[0],
+            frame: u16::from_be_bytes([data[2], data[3]]),
+            events: data[4..]
+                .chunks(4)
+                .take(count)
+                .map(|record| LoggedEvent {
+                    frame: u16::from_be_bytes([record[2], record[3]]),
+                    event: DeviceEvent::decode(record[0], record[1]),
+                })
+                .collect(),
+        }
+    }
+}
+
+#[derive(Debug, Copy, Clone, Eq, PartialEq)]
+pub enum Source {
+    Host,
+    Device,
+}
+
+#[derive(Debug, Clone)]
+pub struct Entry {
+    /// Milliseconds since the start of the timeline. Device events that
+    /// happened earlier are negative
+    pub millis: f64,
+    pub source: Source,
+    pub description: String,
+}
+
+/// Host milestones and device events on a single time axis
+pub struct Timeline {
+    start: Instant,
+    entries: Vec<Entry>,
+}
+
+impl Default for Timeline {
+    fn default() -> Timeline {
+        Timeline::new()
+    }
+}
+
+impl Timeline {
+    pub fn new() -> Timeline {
+        Timeline {
+            start: Instant::now(),
+            entries: Vec::new(),
+        }
+    }
+    fn millis(&self, instant: Instant) -> f64 {
+        if instant >= self.start {
+            (instant - self.start).as_secs_f64() * 1000.0
+        } else {
+            -(self.start - instant).as_secs_f64() * 1000.0
+        }
+    }
+    /// Records a host-side event that happens now
+    pub fn mark(&mut self, description: impl Into<String>) {
+        self.entries.push(Entry {
+            millis: self.millis(Instant::now()),
+            source: Source::Host,
+            description: description.into(),
+        });
+    }
+    /// Drains the device event log and adds the events to the timeline
+    pub fn drain(&mut self, gbl32: &mut Gbl32) -> Result<(), Gbl32Error> {
+        let sent = Instant::now();
+        let log = gbl32.drain_events()?;
+        let received = Instant::now();
+        self.add_events(&log, sent + (received - sent) / 2);
+        Ok(())
+    }
+    /// Adds drained events, given the host time matching `log.frame`
+    pub fn add_events(&mut self, log: &EventLog, reference: Instant) {
+        let reference = self.millis(reference);
+        let at = |frame: u16| {
+            let age = FRAME_DURATION * log.frame.wrapping_sub(frame) as u32;
+            reference - age.as_secs_f64() * 1000.0
+        };
+        // Frame stamps restart at boot, so events from before the latest
+        // boot can't be placed exactly. They are shown at the boot instead
+        let boot = log
+            .events
+            .iter()
+            .rposition(|logged| matches!(logged.event, DeviceEvent::Boot { .. }));
+        let boot_millis = boot.map(|index| at(log.events[index].frame));
+        if log.dropped > 0 {
+            // Dropped events were older than any drained one
+            let millis = match (boot_millis, log.events.first()) {
+                (Some(boot_millis), _) => boot_millis,
+                (None, Some(first)) => at(first.frame),
+                (None, None) => reference,
+            };
+            self.entries.push(Entry {
+                millis,
+                source: Source::Device,
+                description: format!("{} earlier events dropped", log.dropped),
+            });
+        }
+        for (index, logged) in log.events.iter().enumerate() {
+            let (millis, description) = match (boot, boot_millis) {
+                (Some(boot), Some(boot_millis)) if index < boot => (
+                    boot_millis,
+                    format!("{} (before reset, frame {})", logged.event, logged.frame),
+                ),
+                _ => (at(logged.frame), logged.event.to_string()),
+            };
+            self.entries.push(Entry {
+                millis,
+                source: Source::Device,
+                description,
+            });
+        }
+    }
+    /// Returns all entries in time order
+    pub fn entries(&self) -> Vec<Entry> {
+        let mut entries = self.entries.clone();
+        entries.sort_by(|a, b| a.millis.total_cmp(&b.millis));
+        entries
+    }
+}
+
+impl fmt::Display for Timeline {
+    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+        for entry in self.entries() {
+            let source = match entry.source {
+                Source::Host => "host",
+                Source::Device => "device",
+            };
+            writeln!(
+                f,
+                "{:>12.3} ms  {:<6}  {}",
+                entry.millis, source, entry.description
+            )?;
+        }
+        Ok(())
+    }
+}
@@ -0,0 +1,501 @@
+//! Protocol traces for diagnosing performance problems.
+//!
+//! A trace contains every frame and raw stream chunk exchanged with a device,
+//! stamped with monotonic time. Traces can be replayed against a real device,
+//! or against a `SimulatedTransport` that answers with the recorded device
+//! data and latencies, and the timing of the replay is compared against the
+//! recording.
+//!
+//! File format (all integers little-endian):
+//!
+//! * header: `GBL32TR` followed by a format version byte
+//! * record: tag (u8), time since previous record in microseconds (u32),
+//!   data length (u32), data
+//!
+//! Tag bit 0 is the direction (0 = host to device), bits 1-2 the kind (0 =
+//! COBS frame including the delimiter, 1 = raw stream chunk, 2 = out-of-band
+//! stream abort without data). Version 1 traces have no aborts.
+use bufstream::BufStream;
+use std::{
+    collections::VecDeque,
+    fmt,
+    io::{self, Read, Write},
+    thread,
+    time::{Duration, Instant},
+};
+
+use crate::Transport;
+
+const MAGIC: &[u8; 7] = b"GBL32TR";
+const FORMAT_VERSION: u8 = 2;
+/// Upper bound for the length of a record. Recorded chunks are at most the
+/// size of SRAM, so anything larger means the file is corrupt
+const MAX_RECORD_LEN: u32 = 0x10000;
+
+#[derive(Debug, Copy, Clone, Eq, PartialEq)]
+pub enum Direction {
+    ToDevice,
+    FromDevice,
+}
+
+#[derive(Debug, Copy, Clone, Eq, PartialEq)]
+pub enum EventKind {
+    Frame,
+    Stream,
+    /// Out-of-band stream abort, see `Transport::abort`
+    Abort,
+}
+
+#[derive(Debug, Clone, Eq, PartialEq)]
+pub struct TraceEvent {
+    /// Time since the start of the trace
+    pub timestamp: Duration,
+    pub direction: Direction,
+    pub kind: EventKind,
+    pub data: Vec<u8>,
+}
+
+fn tag(direction: Direction, kind: EventKind) -> u8 {
+    let direction = match direction {
+        Direction::ToDevice => 0,
+        Direction::FromDevice => 1,
+    };
+    let kind = match kind {
+        EventKind::Frame => 0,
+        EventKind::Stream => 2,
+        EventKind::Abort => 4,
+    };
+    direction | kind
+}
+
+/// Records events into a trace file as they happen
+pub struct TraceRecorder {
+    writer: Box<dyn Write + Send>,
+    start: Instant,
+    previous: Duration,
+}
+
+impl TraceRecorder {
+    pub fn new(mut writer: Box<dyn Write + Send>) -> io::Result<TraceRecorder> {
+        writer.write_all(MAGIC)?;
+        writer.write_all(&[FORMAT_VERSION])?;
+        Ok(TraceRecorder {
+            writer,
+            start: Instant::now(),
+            previous: Duration::ZERO,
+        })
+    }
+    pub fn record(&mut self, direction: Direction, kind: EventKind, data: &[u8]) -> io::Result<()> {
+        self.record_at(Instant::now(), direction, kind, data)
+    }
+    /// Records an event that happened at `at`, e.g. data received on another
+    /// thread. Events must be recorded in time order
+    pub fn record_at(
+        &mut self,
+        at: Instant,
+        direction: Direction,
+        kind: EventKind,
+        data: &[u8],
+    ) -> io::Result<()> {
+        let timestamp = at.saturating_duration_since(self.start).max(self.previous);
+        let delta = (timestamp - self.previous).as_micros();
+        self.previous = timestamp;
+        self.writer.write_all(&[tag(direction, kind)])?;
+        self.writer
+            .write_all(&u32::try_from(delta).unwrap_or(u32::MAX).to_le_bytes())?;
+        self.writer.write_all(&(data.len() as u32).to_le_bytes())?;
+        self.writer.write_all(data)
+    }
+    pub fn flush(&mut self) -> io::Result<()> {
+        self.writer.flush()
+    }
+}
+
+impl Drop for TraceRecorder {
+    fn drop(&mut self) {
+        let _ = self.writer.flush();
+    }
+}
+
+pub fn read_trace<R: Read>(mut reader: R) -> io::Result<Vec<TraceEvent>> {
+    let mut header = [0; 8];
+    reader.read_exact(&mut header)?;
+    if &header[..7] != MAGIC || !(1..=FORMAT_VERSION).contains(&header[7]) {
+        return Err(io::Error::new(
+            io::ErrorKind::InvalidData,
+            "Not a supported GB-LIVE32 trace file",
+        ));
+    }
+    let mut events = Vec::new();
+    let mut timestamp = Duration::ZERO;
+    loop {
+        let mut tag = [0; 1];
+        match reader.read_exact(&mut tag) {
+            Err(ref e) if e.kind() == io::ErrorKind::UnexpectedEof => break,
+            result => result?,
+        }
+        let mut fields = [0; 8];
+        reader.read_exact(&mut fields)?;
+        let delta = u32::from_le_bytes([fields[0], fields[1], fields[2], fields[3]]);
+        let len = u32::from_le_bytes([fields[4], fields[5], fields[6], fields[7]]);
+        if len > MAX_RECORD_LEN {
+            return Err(io::Error::new(
+                io::ErrorKind::InvalidData,
+                format!("Trace record too long ({} bytes)", len),
+            ));
+        }
+        let kind = match (tag[0] >> 1) & 0x03 {
+            0 => EventKind::Frame,
+            1 => EventKind::Stream,
+            2 => EventKind::Abort,
+            _ => {
+                return Err(io::Error::new(
+                    io::ErrorKind::InvalidData,
+                    format!("Unknown trace record tag {:02x}", tag[0]),
+                ))
+            }
+        };
+        let mut data = vec![0; len as usize];
+        reader.read_exact(&mut data)?;
+        timestamp += Duration::from_micros(delta as u64);
+        events.push(TraceEvent {
+            timestamp,
+            direction: if tag[0] & 1 == 0 {
+                Direction::ToDevice
+            } else {
+                Direction::FromDevice
+            },
+            kind,
+            data,
+        });
+    }
+    Ok(events)
+}
+
+/// Transport that plays the device side of a recorded trace.
+///
+/// Writes are accepted and discarded. Each recorded device response becomes
+/// readable after the same delay it had in the recording, measured from the
+/// latest write.
+pub struct SimulatedTransport {
+    responses: VecDeque<(Duration, Vec<u8>)>,
+    pending: VecDeque<u8>,
+    last_write: Instant,
+}
+
+impl SimulatedTransport {
+    pub fn new(events: &[TraceEvent]) -> SimulatedTransport {
+        let mut responses = VecDeque::new();
+        let mut last_write = Duration::ZERO;
+        for event in events {
+            match event.direction {
+                Direction::ToDevice => last_write = event.timestamp,
+                Direction::FromDevice => responses.push_back((
+                    event.timestamp.saturating_sub(last_write),
+                    event.data.clone(),
+                )),
+            }
+        }
+        SimulatedTransport {
+            responses,
+            pending: VecDeque::new(),
+            last_write: Instant::now(),
+        }
+    }
+}
+
+impl Read for SimulatedTransport {
+    fn read(&mut self, buf: &mut [u8]) -> io::Result<usize> {
+        if self.pending.is_empty() {
+            let (latency, data) = self
+                .responses
+                .pop_front()
+                .ok_or_else(|| io::Error::new(io::ErrorKind::TimedOut, "End of simulated trace"))?;
+            let ready = self.last_write + latency;
+            let now = Instant::now();
+            if ready > now {
+                thread::sleep(ready - now);
+            }
+            self.pending.extend(data);
+        }
+        let len = buf.len().min(self.pending.len());
+        for (dst, src) in buf.iter_mut().zip(self.pending.drain(..len)) {
+            *dst = src;
+        }
+        Ok(len)
+    }
+}
+
+impl Write for SimulatedTransport {
+    fn write(&mut self, buf: &[u8]) -> io::Result<usize> {
+        self.last_write = Instant::now();
+        Ok(buf.len())
+    }
+    fn flush(&mut self) -> io::Result<()> {
+        Ok(())
+    }
+}
+
+impl Transport for SimulatedTransport {
+    fn set_timeout(&mut self, _: Duration) -> io::Result<()> {
+        Ok(())
+    }
+    fn clear(&mut self) -> io::Result<()> {
+        self.pending.clear();
+        Ok(())
+    }
+    fn try_clone(&self) -> io::Result<Box<dyn Transport>> {
+        Err(io::Error::new(
+            io::ErrorKind::Unsupported,
+            "Simulated transport can't be cloned",
+        ))
+    }
+    fn abort(&mut self) -> io::Result<()> {
+        self.last_write = Instant::now();
+        Ok(())
+    }
+}
+
+/// Timing of one device response during a replay
+#[derive(Debug, Copy, Clone, Eq, PartialEq)]
+pub struct ReplayLatency {
+    /// Index of the response event in the trace
+    pub index: usize,
+    pub kind: EventKind,
+    /// Time from the preceding host write to the response in the recording
+    pub recorded: Duration,
+    /// Time from the preceding host write to the response in the replay
+    pub replayed: Duration,
+}
+
+impl ReplayLatency {
+    pub fn slowdown(&self) -> Duration {
+        self.replayed.saturating_sub(self.recorded)
+    }
+}
+
+#[derive(Debug, Clone, Default)]
+pub struct ReplayReport {
+    pub events: usize,
+    /// Number of responses whose data differed from the recording
+    pub mismatches: usize,
+    pub recorded: Duration,
+    pub replayed: Duration,
+    pub latencies: Vec<ReplayLatency>,
+}
+
+impl ReplayReport {
+    /// Returns the `count` responses that were delayed the most compared to
+    /// the recording
+    pub fn worst(&self, count: usize) -> Vec<ReplayLatency> {
+        let mut latencies = self.latencies.clone();
+        latencies.sort_by_key(|latency| std::cmp::Reverse(latency.slowdown()));
+        latencies.truncate(count);
+        latencies
+    }
+}
+
+impl fmt::Display for ReplayReport {
+    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+        let total = |kind| {
+            self.latencies
+                .iter()
+                .filter(|latency| latency.kind == kind)
+                .fold((Duration::ZERO, Duration::ZERO), |(r, p), latency| {
+                    (r + latency.recorded, p + latency.replayed)
+                })
+        };
+        let (frame_recorded, frame_replayed) = total(EventKind::Frame);
+        let (stream_recorded, stream_replayed) = total(EventKind::Stream);
+        write!(
+            f,
+            "{} events, {} mismatches, total {:?} (recorded {:?}), frame latency {:?} (recorded {:?}), stream latency {:?} (recorded {:?})",
+            self.events,
+            self.mismatches,
+            self.replayed,
+            self.recorded,
+            frame_replayed,
+            frame_recorded,
+            stream_replayed,
+            stream_recorded
+        )
+    }
+}
+
+/// Replays the host side of a trace, and measures how long each recorded
+/// device response takes to arrive.
+///
+/// Recorded aborts are repeated on the transport, and input that arrives
+/// shortly after them is discarded like `Gbl32::resync` does.
+pub fn replay<T: Transport + ?Sized>(
+    port: &mut BufStream<Box<T>>,
+    events: &[TraceEvent],
+) -> io::Result<ReplayReport> {
+    let mut report = ReplayReport {
+        events: events.len(),
+        recorded: events.last().map_or(Duration::ZERO, |e| e.timestamp),
+        ..ReplayReport::default()
+    };
+    let start = Instant::now();
+    let mut recorded_write = Duration::ZERO;
+    let mut replayed_write = start;
+    let mut buffer = Vec::new();
+    for (index, event) in events.iter().enumerate() {
+        match event.direction {
+            Direction::ToDevice => {
+                recorded_write = event.timestamp;
+                replayed_write = Instant::now();
+                if event.kind == EventKind::Abort {
+                    port.get_mut().abort()?;
+                    thread::sleep(Duration::from_millis(1));
+                    port.get_mut().clear()?;
+                } else {
+                    port.write_all(&event.data)?;
+                    port.flush()?;
+                }
+            }
+            Direction::FromDevice => {
+                buffer.resize(event.data.len(), 0);
+                port.read_exact(&mut buffer)?;
+                if buffer != event.data {
+                    report.mismatches += 1;
+                }
+                report.latencies.push(ReplayLatency {
+                    index,
+                    kind: event.kind,
+                    recorded: event.timestamp.saturating_sub(recorded_write),
+                    replayed: replayed_write.elapsed(),
+                });
+            }
+        }
+    }
+    report.replayed = start.elapsed();
+    Ok(report)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::sync::{Arc, Mutex};
+
+    #[derive(Clone, Default)]
+    struct SharedBuffer(Arc<Mutex<Vec<u8>>>);
+
+    impl Write for SharedBuffer {
+        fn write(&mut self, buf: &[u8]) -> io::Result<usize> {
+            self.0.lock().unwrap().extend_from_slice(buf);
+            Ok(buf.len())
+        }
+        fn flush(&mut self) -> io::Result<()> {
+            Ok(())
+        }
+    }
+
+    fn event(millis: u64, direction: Direction, kind: EventKind, data: &[u8]) -> TraceEvent {
+        TraceEvent {
+            timestamp: Duration::from_millis(millis),
+            direction,
+            kind,
+            data: data.to_vec(),
+        }
+    }
+
+    #[test]
+    fn recorded_trace_reads_back() {
+        let buffer = SharedBuffer::default();
+        let mut recorder = TraceRecorder::new(Box::new(buffer.clone())).unwrap();
+        let recorded = [
+            (Direction::ToDevice, EventKind::Abort, &[][..]),
+            (Direction::ToDevice, EventKind::Frame, &[0x00][..]),
+            (
+                Direction::FromDevice,
+                EventKind::Frame,
+                &[0x03, 0xff, 0x01, 0x00][..],
+            ),
+            (Direction::FromDevice, EventKind::Stream, &[0x12; 300][..]),
+        ];
+        for (direction, kind, data) in recorded {
+            recorder.record(direction, kind, data).unwrap();
+        }
+        drop(recorder);
+
+        let data = buffer.0.lock().unwrap().clone();
+        let events = read_trace(&data[..]).unwrap();
+        assert_eq!(events.len(), recorded.len());
+        for (event, (direction, kind, data)) in events.iter().zip(recorded) {
+            assert_eq!(event.direction, direction);
+            assert_eq!(event.kind, kind);
+            assert_eq!(event.data, data);
+        }
+        assert!(events
+            .windows(2)
+            .all(|pair| pair[0].timestamp <= pair[1].timestamp));
+    }
+
+    #[test]
+    fn corrupt_record_length_is_rejected() {
+        let mut data = Vec::from(&MAGIC[..]);
+        data.push(FORMAT_VERSION);
+        data.push(0x01);
+        data.extend(0u32.to_le_bytes());
+        data.extend(u32::MAX.to_le_bytes());
+        let err = read_trace(&data[..]).unwrap_err();
+        assert_eq!(err.kind(), io::ErrorKind::InvalidData);
+    }
+
+    #[test]
+    fn replay_against_simulated_device() {
+        let events = [
+            event(
+                0,
+                Direction::ToDevice,
+                EventKind::Frame,
+                &[0x02, 0x0b, 0x00],
+            ),
+            event(
+                5,
+                Direction::FromDevice,
+                EventKind::Frame,
+                &[0x04, 0x80, 0x00, 0xff],
+            ),
+            event(
+                5,
+                Direction::FromDevice,
+                EventKind::Frame,
+                &[0x02, 0x0b, 0x00],
+            ),
+            event(6, Direction::ToDevice, EventKind::Abort, &[]),
+            event(6, Direction::ToDevice, EventKind::Frame, &[0x00]),
+            event(
+                7,
+                Direction::ToDevice,
+                EventKind::Frame,
+                &[0x02, 0x0a, 0x00],
+            ),
+            event(
+                9,
+                Direction::FromDevice,
+                EventKind::Frame,
+                &[0x01, 0xff, 0x0a, 0x00],
+            ),
+            event(12, Direction::FromDevice, EventKind::Stream, &[0x5a; 64]),
+        ];
+        let transport: Box<dyn Transport> = Box::new(SimulatedTransport::new(&events));
+        let mut port = BufStream::new(transport);
+        let report = replay(&mut port, &events).unwrap();
+
+        assert_eq!(report.events, events.len());
+        assert_eq!(report.mismatches, 0);
+        assert_eq!(report.recorded, Duration::from_millis(12));
+        let indices = report
+            .latencies
+            .iter()
+            .map(|latency| latency.index)
+            .collect::<Vec<_>>();
+        assert_eq!(indices, [1, 2, 6, 7]);
+        // Responses are not delivered before their recorded latency
+        for latency in &report.latencies {
+            assert!(latency.replayed >= latency.recorded);
+        }
+    }
+}
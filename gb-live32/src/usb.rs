@@ -0,0 +1,563 @@
+//! Transport over the vendor-specific bulk interface of firmware v2.2 and
+//! later.
+//!
+//! Transfers go through libusb's asynchronous API, so command frames bypass
+//! the serial driver entirely. A queue of IN transfers is kept submitted at
+//! all times, so the host controller polls the device continuously, and
+//! several OUT transfers can be in flight at once. Each IN transfer receives
+//! one packet, because the firmware doesn't end responses with zero-length
+//! packets. Completions are handled by an event thread with its own libusb
+//! context.
+//!
+//! Any USB device that enumerates with the same interface works, including
+//! gadgets on dummy_hcd / raw-gadget and devices imported with USB/IP. The
+//! ignored tests at the end of this file exercise the transport against such
+//! a device.
+//!
+//! On Windows, the vendor interface needs the WinUSB driver. If it can't be
+//! claimed, the CDC interface is used instead.
+use libusb1_sys::{
+    constants::{
+        LIBUSB_TRANSFER_CANCELLED, LIBUSB_TRANSFER_COMPLETED, LIBUSB_TRANSFER_NO_DEVICE,
+        LIBUSB_TRANSFER_OVERFLOW, LIBUSB_TRANSFER_STALL, LIBUSB_TRANSFER_TIMED_OUT,
+    },
+    libusb_alloc_transfer, libusb_cancel_transfer, libusb_error_name, libusb_fill_bulk_transfer,
+    libusb_free_transfer, libusb_submit_transfer, libusb_transfer,
+};
+use rusb::{Context, Device as UsbDevice, DeviceHandle, UsbContext};
+use std::{
+    collections::{HashSet, VecDeque},
+    ffi::{CStr, OsStr},
+    io::{self, Read, Write},
+    os::raw::{c_int, c_void},
+    ptr::NonNull,
+    sync::{Arc, Condvar, Mutex, MutexGuard},
+    thread::{self, JoinHandle},
+    time::{Duration, Instant},
+};
+
+use crate::Transport;
+
+const VENDOR_INTERFACE: u8 = 2;
+const VENDOR_EP: u8 = 3;
+const PACKET_SIZE: usize = 64;
+/// Number of IN transfers kept submitted. Each one receives one packet, so
+/// responses that end on a packet boundary complete immediately
+const IN_QUEUE_DEPTH: usize = 32;
+/// Maximum size and number of in-flight OUT transfers
+const OUT_TRANSFER_SIZE: usize = 4096;
+const OUT_QUEUE_DEPTH: usize = 8;
+const REQUEST_ABORT: u8 = 0x01;
+const ABORT_TIMEOUT: Duration = Duration::from_secs(1);
+/// How often the event thread checks whether it should stop
+const EVENT_POLL: Duration = Duration::from_millis(100);
+
+fn usb_io_error(e: rusb::Error) -> io::Error {
+    match e {
+        rusb::Error::Timeout => io::Error::new(io::ErrorKind::TimedOut, "USB transfer timed out"),
+        e => io::Error::other(e),
+    }
+}
+
+fn libusb_io_error(code: c_int) -> io::Error {
+    let name = unsafe { CStr::from_ptr(libusb_error_name(code)) };
+    io::Error::other(name.to_string_lossy().into_owned())
+}
+
+fn transfer_io_error(status: c_int) -> io::Error {
+    match status {
+        LIBUSB_TRANSFER_TIMED_OUT => {
+            io::Error::new(io::ErrorKind::TimedOut, "USB transfer timed out")
+        }
+        LIBUSB_TRANSFER_NO_DEVICE => {
+            io::Error::new(io::ErrorKind::NotConnected, "USB device disconnected")
+        }
+        LIBUSB_TRANSFER_STALL => io::Error::other("USB endpoint stalled"),
+        LIBUSB_TRANSFER_OVERFLOW => io::Error::other("USB transfer overflowed"),
+        _ => io::Error::other("USB transfer failed"),
+    }
+}
+
+#[derive(Default)]
+struct Queues {
+    /// Received data that hasn't been read yet
+    rx: VecDeque<u8>,
+    /// Addresses of all submitted transfers
+    pending_in: HashSet<usize>,
+    pending_out: HashSet<usize>,
+    /// Set when the device is closed, so IN transfers aren't resubmitted
+    stopping: bool,
+    /// Failure of a completed transfer, reported by the next operation
+    error: Option<io::Error>,
+}
+
+struct Shared {
+    context: Context,
+    handle: DeviceHandle<Context>,
+    queues: Mutex<Queues>,
+    /// Signaled whenever transfers have completed
+    completed: Condvar,
+}
+
+/// Transfer allocated from libusb. While submitted, the box is owned by
+/// libusb through the transfer's user data
+struct Transfer {
+    raw: NonNull<libusb_transfer>,
+    buffer: Vec<u8>,
+    /// Keeps the device handle open until the transfer is freed
+    shared: Arc<Shared>,
+}
+
+impl Transfer {
+    fn new(shared: &Arc<Shared>, buffer: Vec<u8>) -> io::Result<Box<Transfer>> {
+        let raw = NonNull::new(unsafe { libusb_alloc_transfer(0) }).ok_or_else(|| {
+            io::Error::new(
+                io::ErrorKind::OutOfMemory,
+                "Failed to allocate USB transfer",
+            )
+        })?;
+        Ok(Box::new(Transfer {
+            raw,
+            buffer,
+            shared: Arc::clone(shared),
+        }))
+    }
+}
+
+impl Drop for Transfer {
+    fn drop(&mut self) {
+        unsafe { libusb_free_transfer(self.raw.as_ptr()) };
+    }
+}
+
+extern "system" fn transfer_completed(raw: *mut libusb_transfer) {
+    // Safety: the user data is the box leaked by Shared::submit
+    let transfer = unsafe { Box::from_raw((*raw).user_data as *mut Transfer) };
+    let shared = Arc::clone(&transfer.shared);
+    shared.complete(transfer);
+}
+
+impl Shared {
+    fn submit(
+        &self,
+        queues: &mut Queues,
+        endpoint: u8,
+        mut transfer: Box<Transfer>,
+    ) -> io::Result<()> {
+        let raw = transfer.raw.as_ptr();
+        let buffer = transfer.buffer.as_mut_ptr();
+        let length = transfer.buffer.len() as c_int;
+        let user_data = Box::into_raw(transfer);
+        unsafe {
+            libusb_fill_bulk_transfer(
+                raw,
+                self.handle.as_raw(),
+                endpoint,
+                buffer,
+                length,
+                transfer_completed,
+                user_data as *mut c_void,
+                0,
+            );
+            let result = libusb_submit_transfer(raw);
+            if result < 0 {
+                drop(Box::from_raw(user_data));
+                return Err(libusb_io_error(result));
+            }
+        }
+        if endpoint & 0x80 != 0 {
+            queues.pending_in.insert(raw as usize);
+        } else {
+            queues.pending_out.insert(raw as usize);
+        }
+        Ok(())
+    }
+    /// Handles a completed transfer. IN transfers are resubmitted
+    /// immediately to keep the queue full
+    fn complete(&self, transfer: Box<Transfer>) {
+        let raw = transfer.raw.as_ptr();
+        let (endpoint, status, len) = unsafe {
+            (
+                (*raw).endpoint,
+                (*raw).status,
+                (*raw).actual_length as usize,
+            )
+        };
+        let mut queues = self.queues.lock().unwrap();
+        if status != LIBUSB_TRANSFER_COMPLETED
+            && status != LIBUSB_TRANSFER_CANCELLED
+            && queues.error.is_none()
+        {
+            queues.error = Some(transfer_io_error(status));
+        }
+        if endpoint & 0x80 != 0 {
+            queues.pending_in.remove(&(raw as usize));
+            queues.rx.extend(&transfer.buffer[..len]);
+            // A failed IN transfer is dropped, and the failure is reported by
+            // the next read
+            if status == LIBUSB_TRANSFER_COMPLETED && !queues.stopping {
+                if let Err(e) = self.submit(&mut queues, endpoint, transfer) {
+                    queues.error.get_or_insert(e);
+                }
+            }
+        } else {
+            queues.pending_out.remove(&(raw as usize));
+        }
+        self.completed.notify_all();
+    }
+    /// Handles events until stopped and all transfers have completed
+    fn run_events(&self) {
+        loop {
+            {
+                let queues = self.queues.lock().unwrap();
+                if queues.stopping && queues.pending_in.is_empty() && queues.pending_out.is_empty()
+                {
+                    break;
+                }
+            }
+            match self.context.handle_events(Some(EVENT_POLL)) {
+                Ok(()) | Err(rusb::Error::Interrupted) => (),
+                Err(e) => {
+                    // Submitted transfers can't complete anymore, so they leak
+                    let mut queues = self.queues.lock().unwrap();
+                    queues.error = Some(usb_io_error(e));
+                    self.completed.notify_all();
+                    break;
+                }
+            }
+        }
+    }
+}
+
+/// Claimed interface and its event thread
+struct Device {
+    shared: Arc<Shared>,
+    events: Option<JoinHandle<()>>,
+}
+
+impl Device {
+    fn lock(&self) -> io::Result<MutexGuard<'_, Queues>> {
+        let mut queues = self.shared.queues.lock().unwrap();
+        match queues.error.take() {
+            Some(e) => Err(e),
+            None => Ok(queues),
+        }
+    }
+    /// Waits until more transfers have completed
+    fn wait<'a>(
+        &'a self,
+        queues: MutexGuard<'a, Queues>,
+        deadline: Instant,
+    ) -> io::Result<MutexGuard<'a, Queues>> {
+        let timeout = deadline.saturating_duration_since(Instant::now());
+        if timeout.is_zero() {
+            return Err(io::Error::new(
+                io::ErrorKind::TimedOut,
+                "USB transfer timed out",
+            ));
+        }
+        let (mut queues, _) = self.shared.completed.wait_timeout(queues, timeout).unwrap();
+        match queues.error.take() {
+            Some(e) => Err(e),
+            None => Ok(queues),
+        }
+    }
+}
+
+impl Drop for Device {
+    fn drop(&mut self) {
+        {
+            let mut queues = self.shared.queues.lock().unwrap();
+            queues.stopping = true;
+            for &raw in queues.pending_in.iter().chain(&queues.pending_out) {
+                unsafe { libusb_cancel_transfer(raw as *mut libusb_transfer) };
+            }
+        }
+        if let Some(events) = self.events.take() {
+            let _ = events.join();
+        }
+        // The interface is released when the last handle reference is dropped
+    }
+}
+
+/// Returns true if the device's active configuration has the vendor interface
+fn has_vendor_interface(device: &UsbDevice<Context>) -> io::Result<bool> {
+    let config = device.active_config_descriptor().map_err(usb_io_error)?;
+    let found = config.interfaces().any(|interface| {
+        interface.descriptors().any(|descriptor| {
+            descriptor.interface_number() == VENDOR_INTERFACE && descriptor.class_code() == 0xff
+        })
+    });
+    Ok(found)
+}
+
+/// Finds the USB device that provides the serial port `port` from sysfs.
+///
+/// The tty belongs to the CDC data interface, whose parent is the device
+#[cfg(target_os = "linux")]
+fn find_device(context: &Context, port: &OsStr) -> io::Result<Option<UsbDevice<Context>>> {
+    use std::{fs, path::Path};
+
+    let tty = Path::new(port)
+        .file_name()
+        .ok_or_else(|| io::Error::new(io::ErrorKind::InvalidInput, "Invalid port name"))?;
+    let interface = Path::new("/sys/class/tty")
+        .join(tty)
+        .join("device")
+        .canonicalize()?;
+    let device = interface
+        .parent()
+        .ok_or_else(|| io::Error::new(io::ErrorKind::NotFound, "USB device not found"))?;
+    let number = |name: &str| -> io::Result<u8> {
+        fs::read_to_string(device.join(name))?
+            .trim()
+            .parse()
+            .map_err(|_| io::Error::new(io::ErrorKind::InvalidData, "Invalid sysfs value"))
+    };
+    let (bus, address) = (number("busnum")?, number("devnum")?);
+    let devices = context.devices().map_err(usb_io_error)?;
+    let found = devices
+        .iter()
+        .find(|device| device.bus_number() == bus && device.address() == address);
+    Ok(found)
+}
+
+/// Returns all connected boards
+#[cfg(any(test, not(target_os = "linux")))]
+fn find_boards(context: &Context) -> io::Result<Vec<UsbDevice<Context>>> {
+    const VENDOR_ID: u16 = 0x16c0;
+    const PRODUCT_ID: u16 = 0x05e1;
+
+    let devices = context.devices().map_err(usb_io_error)?;
+    let boards = devices
+        .iter()
+        .filter(|device| {
+            device
+                .device_descriptor()
+                .map(|descriptor| {
+                    descriptor.vendor_id() == VENDOR_ID && descriptor.product_id() == PRODUCT_ID
+                })
+                .unwrap_or(false)
+        })
+        .collect();
+    Ok(boards)
+}
+
+/// Finds the USB device that provides the serial port `port`.
+///
+/// Serial port names can't be mapped to USB devices here, and the board has
+/// no serial number, so this only succeeds if exactly one board is connected
+#[cfg(not(target_os = "linux"))]
+fn find_device(context: &Context, _port: &OsStr) -> io::Result<Option<UsbDevice<Context>>> {
+    let mut boards = find_boards(context)?;
+    match boards.len() {
+        1 => Ok(boards.pop()),
+        _ => Ok(None),
+    }
+}
+
+pub struct UsbTransport {
+    device: Arc<Device>,
+    timeout: Duration,
+}
+
+impl UsbTransport {
+    /// Opens the vendor interface of the device that provides the serial
+    /// port `port`.
+    ///
+    /// Returns `None` if the device has no vendor interface (firmware older
+    /// than v2.2, or built without it) or can't be identified, so the CDC
+    /// interface should be used.
+    pub fn open_for_port(port: &OsStr) -> io::Result<Option<UsbTransport>> {
+        let context = Context::new().map_err(usb_io_error)?;
+        match find_device(&context, port)? {
+            Some(device) if has_vendor_interface(&device)? => UsbTransport::open(&device).map(Some),
+            _ => Ok(None),
+        }
+    }
+    /// Claims the vendor interface of `device`
+    pub fn open(device: &UsbDevice<Context>) -> io::Result<UsbTransport> {
+        let mut handle = device.open().map_err(usb_io_error)?;
+        handle
+            .claim_interface(VENDOR_INTERFACE)
+            .map_err(usb_io_error)?;
+        let shared = Arc::new(Shared {
+            context: device.context().clone(),
+            handle,
+            queues: Mutex::new(Queues::default()),
+            completed: Condvar::new(),
+        });
+        // From here on, dropping the device cancels submitted transfers
+        let mut device = Device {
+            shared: Arc::clone(&shared),
+            events: None,
+        };
+        device.events = Some({
+            let shared = Arc::clone(&shared);
+            thread::spawn(move || shared.run_events())
+        });
+        {
+            let mut queues = shared.queues.lock().unwrap();
+            for _ in 0..IN_QUEUE_DEPTH {
+                let transfer = Transfer::new(&shared, vec![0; PACKET_SIZE])?;
+                shared.submit(&mut queues, VENDOR_EP | 0x80, transfer)?;
+            }
+        }
+        Ok(UsbTransport {
+            device: Arc::new(device),
+            timeout: Duration::from_secs(1),
+        })
+    }
+}
+
+impl Read for UsbTransport {
+    fn read(&mut self, buf: &mut [u8]) -> io::Result<usize> {
+        let deadline = Instant::now() + self.timeout;
+        let mut queues = self.device.lock()?;
+        while queues.rx.is_empty() {
+            queues = self.device.wait(queues, deadline)?;
+        }
+        let len = buf.len().min(queues.rx.len());
+        for (dst, src) in buf.iter_mut().zip(queues.rx.drain(..len)) {
+            *dst = src;
+        }
+        Ok(len)
+    }
+}
+
+impl Write for UsbTransport {
+    fn write(&mut self, buf: &[u8]) -> io::Result<usize> {
+        let deadline = Instant::now() + self.timeout;
+        let mut queues = self.device.lock()?;
+        while queues.pending_out.len() >= OUT_QUEUE_DEPTH {
+            queues = self.device.wait(queues, deadline)?;
+        }
+        let len = buf.len().min(OUT_TRANSFER_SIZE);
+        let shared = &self.device.shared;
+        let transfer = Transfer::new(shared, buf[..len].to_vec())?;
+        shared.submit(&mut queues, VENDOR_EP, transfer)?;
+        Ok(len)
+    }
+    fn flush(&mut self) -> io::Result<()> {
+        let deadline = Instant::now() + self.timeout;
+        let mut queues = self.device.lock()?;
+        while !queues.pending_out.is_empty() {
+            queues = self.device.wait(queues, deadline)?;
+        }
+        Ok(())
+    }
+}
+
+impl Transport for UsbTransport {
+    fn set_timeout(&mut self, timeout: Duration) -> io::Result<()> {
+        self.timeout = timeout;
+        Ok(())
+    }
+    fn clear(&mut self) -> io::Result<()> {
+        let mut queues = self.device.shared.queues.lock().unwrap();
+        queues.rx.clear();
+        queues.error = None;
+        Ok(())
+    }
+    fn try_clone(&self) -> io::Result<Box<dyn Transport>> {
+        Ok(Box::new(UsbTransport {
+            device: Arc::clone(&self.device),
+            timeout: self.timeout,
+        }))
+    }
+    fn abort(&mut self) -> io::Result<()> {
+        let shared = &self.device.shared;
+        {
+            // Queued OUT transfers must not reach the device after the abort.
+            // Failures of earlier transfers are discarded by the following
+            // clear(), so they aren't reported here
+            let deadline = Instant::now() + ABORT_TIMEOUT;
+            let mut queues = shared.queues.lock().unwrap();
+            for &raw in &queues.pending_out {
+                unsafe { libusb_cancel_transfer(raw as *mut libusb_transfer) };
+            }
+            while !queues.pending_out.is_empty() {
+                let timeout = deadline.saturating_duration_since(Instant::now());
+                if timeout.is_zero() {
+                    return Err(io::Error::new(
+                        io::ErrorKind::TimedOut,
+                        "USB transfer timed out",
+                    ));
+                }
+                queues = shared.completed.wait_timeout(queues, timeout).unwrap().0;
+            }
+        }
+        // The lock must not be held here, because synchronous transfers
+        // handle events and so run completion callbacks
+        shared
+            .handle
+            .write_control(
+                0x41,
+                REQUEST_ABORT,
+                0,
+                VENDOR_INTERFACE as u16,
+                &[],
+                ABORT_TIMEOUT,
+            )
+            .map_err(usb_io_error)?;
+        Ok(())
+    }
+}
+
+/// Tests against a connected board, which can also be a gadget on
+/// dummy_hcd / raw-gadget or a device imported with USB/IP. Run with
+/// `cargo test -- --ignored --test-threads=1`.
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::Gbl32;
+    use rand::{rngs::SmallRng, RngCore, SeedableRng};
+
+    fn connect() -> Gbl32 {
+        let context = Context::new().unwrap();
+        let board = find_boards(&context)
+            .unwrap()
+            .into_iter()
+            .find(|board| has_vendor_interface(board).unwrap())
+            .expect("no board with the vendor interface");
+        let transport = UsbTransport::open(&board).unwrap();
+        Gbl32::from_transport(Box::new(transport)).unwrap()
+    }
+
+    #[test]
+    #[ignore]
+    fn ping() {
+        let mut gbl32 = connect();
+        for len in [0, 1, PACKET_SIZE - 3, PACKET_SIZE, 200] {
+            let data: Vec<u8> = (0..len).map(|i| i as u8).collect();
+            assert!(gbl32.ping(&data).unwrap());
+        }
+    }
+
+    #[test]
+    #[ignore]
+    fn stream_round_trip() {
+        let mut gbl32 = connect();
+        let mut image = vec![0; 32768];
+        SmallRng::seed_from_u64(0).fill_bytes(&mut image);
+        gbl32.set_unlocked(true).unwrap();
+        gbl32.set_reset(true).unwrap();
+        gbl32.set_passthrough(false).unwrap();
+        gbl32.write_all(&image).unwrap();
+        assert!(gbl32.read_all().unwrap() == image);
+    }
+
+    #[test]
+    #[ignore]
+    fn resync_discards_queued_writes() {
+        let mut gbl32 = connect();
+        gbl32.set_unlocked(true).unwrap();
+        gbl32.set_reset(true).unwrap();
+        gbl32.set_passthrough(false).unwrap();
+        // Queue part of a stream without waiting for it, then abandon it
+        gbl32.start_stream(0x09, 0, 32768).unwrap();
+        gbl32.port.get_mut().write_all(&[0x55; 16384]).unwrap();
+        gbl32.resync().unwrap();
+        assert!(gbl32.ping(b"after abort").unwrap());
+    }
+}